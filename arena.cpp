@@ -0,0 +1,130 @@
+// file: "arena.cpp"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+//-----------------------------------------------------------------------------
+
+#include "arena.h"
+#include "rtlib.h"
+
+//-----------------------------------------------------------------------------
+
+// "arena" class implementation.
+
+// Each chunk starts with a header that links it to the previous chunk
+// and records where the chunk ends.  The header is 8 bytes long so the
+// first allocation in a chunk is 8 byte aligned.
+
+struct arena_chunk
+  {
+    arena_chunk* prev;
+    uint8* limit;
+  };
+
+#define ALIGN8(x) ((CAST(uint32,x) + 7) & ~7)
+
+arena::arena (size_t chunk_size)
+{
+  _chunk = NULL;
+  _buf = NULL;
+  _buf_limit = NULL;
+  _ptr = NULL;
+  _limit = NULL;
+  _chunk_size = chunk_size;
+}
+
+arena::arena (void* buf, size_t size, size_t chunk_size)
+{
+  _chunk = NULL;
+  _buf = CAST(uint8*,ALIGN8(buf));
+  _buf_limit = CAST(uint8*,buf) + size;
+  if (_buf > _buf_limit)
+    _buf = _buf_limit;
+  _ptr = _buf;
+  _limit = _buf_limit;
+  _chunk_size = chunk_size;
+}
+
+arena::~arena ()
+{
+  release ();
+}
+
+void* arena::alloc (size_t size)
+{
+  size = ALIGN8(size);
+
+  if (CAST(size_t,_limit - _ptr) < size)
+    return alloc_in_new_chunk (size);
+
+  void* result = _ptr;
+
+  _ptr += size;
+
+  return result;
+}
+
+void* arena::alloc_in_new_chunk (size_t size)
+{
+  size_t n = sizeof (arena_chunk) + size;
+
+  if (n < _chunk_size)
+    n = _chunk_size;
+
+  arena_chunk* c = CAST(arena_chunk*,kmalloc (n));
+
+  if (c == NULL)
+    return NULL;
+
+  c->prev = _chunk;
+  c->limit = CAST(uint8*,c) + n;
+
+  _chunk = c;
+  _ptr = CAST(uint8*,c + 1) + size;
+  _limit = c->limit;
+
+  return c + 1;
+}
+
+arena::mark arena::checkpoint ()
+{
+  mark m;
+
+  m.chunk = _chunk;
+  m.ptr = _ptr;
+
+  return m;
+}
+
+void arena::rewind (mark m)
+{
+  while (_chunk != m.chunk)
+    {
+      arena_chunk* c = _chunk;
+      _chunk = c->prev;
+      kfree (c);
+    }
+
+  _ptr = m.ptr;
+  _limit = (_chunk == NULL) ? _buf_limit : _chunk->limit;
+}
+
+void arena::release ()
+{
+  mark m;
+
+  m.chunk = NULL;
+  m.ptr = _buf;
+
+  rewind (m);
+}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -9,6 +9,7 @@
 //-----------------------------------------------------------------------------
 
 #include "fifo.h"
+#include "pool.h"
 
 //-----------------------------------------------------------------------------
 
@@ -24,6 +25,20 @@ fifo::~fifo ()
 {
 }
 
+static object_pool<fifo, 16, TRUE> fifo_pool;
+
+void* fifo::operator new (size_t size)
+{
+  void* obj = fifo_pool.allocate (size);
+  return (obj != NULL) ? obj : ::operator new (size);
+}
+
+void fifo::operator delete (void* obj)
+{
+  if (!fifo_pool.release (obj))
+    ::operator delete (obj);
+}
+
 #ifdef SOLUTION
 
 void fifo::put (uint8 byte)
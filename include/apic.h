@@ -12,6 +12,7 @@
 //-----------------------------------------------------------------------------
 
 #include "general.h"
+#include "asm.h"
 
 //-----------------------------------------------------------------------------
 
@@ -25,9 +26,83 @@
 
 #define MSR_APIC_BASE 0xfee00000
 #define MSR_APIC_E    (1<<11)
+#define MSR_APIC_EXTD (1<<10) // x2APIC mode
 #define MSR_APIC_BSP  (1<<8)
 
-#define APIC_REG(n) *CAST(volatile uint32*,MSR_APIC_BASE+(n))
+#define APIC_MMIO_REG(n) *CAST(volatile uint32*,MSR_APIC_BASE+(n))
+
+#ifdef USE_X2APIC
+
+// In x2APIC mode, the register at offset "n" of the memory mapped
+// registers is the MSR X2APIC_MSR(n).  "APIC_REG" yields an object
+// which can be read and assigned like the memory mapped register, and
+// which uses the access method of the current mode.
+
+#define X2APIC_MSR(n) (0x800+((n)>>4))
+
+extern bool apic_x2; // TRUE when the local APIC is in x2APIC mode
+
+class apic_reg
+  {
+  public:
+
+    explicit apic_reg (uint32 offset) { _offset = offset; }
+
+    operator uint32 () const
+      {
+        if (apic_x2)
+          return rdmsr (X2APIC_MSR(_offset));
+        else
+          return APIC_MMIO_REG(_offset);
+      }
+
+    const apic_reg& operator= (uint32 val) const
+      {
+        if (apic_x2)
+          wrmsr (X2APIC_MSR(_offset), val);
+        else
+          APIC_MMIO_REG(_offset) = val;
+        return *this;
+      }
+
+  private:
+
+    uint32 _offset;
+  };
+
+#define APIC_REG(n) apic_reg (n)
+
+// The ID is in the upper 8 bits in xAPIC mode and uses the whole
+// register in x2APIC mode.  The interrupt command register is a
+// single 64 bit MSR in x2APIC mode.
+
+#define apic_id() \
+(apic_x2 ? CAST(uint32,APIC_LOCAL_APIC_ID) : APIC_LOCAL_APIC_ID >> 24)
+
+#define apic_send_ipi(dest,cmd) \
+do { \
+     if (apic_x2) \
+       wrmsr (X2APIC_MSR(0x0300), (CAST(uint64,dest) << 32) | (cmd)); \
+     else \
+       { \
+         APIC_ICR2 = CAST(uint32,dest) << 24; \
+         APIC_ICR1 = (cmd); \
+       } \
+   } while (0)
+
+#else
+
+#define APIC_REG(n) APIC_MMIO_REG(n)
+
+#define apic_id() (APIC_LOCAL_APIC_ID >> 24)
+
+#define apic_send_ipi(dest,cmd) \
+do { \
+     APIC_ICR2 = CAST(uint32,dest) << 24; \
+     APIC_ICR1 = (cmd); \
+   } while (0)
+
+#endif
 
 #define APIC_LOCAL_APIC_ID       APIC_REG (0x0020)
 #define APIC_LOCAL_APIC_VERSION  APIC_REG (0x0030)
@@ -0,0 +1,73 @@
+// file: "arena.h"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+// "arena" class declaration.
+//
+// An arena is a scratch allocator for short-lived objects.  Memory is
+// allocated by incrementing a pointer in the current chunk; when the
+// chunk is full a new chunk is obtained from "kmalloc".  Individual
+// objects are never freed: "rewind" releases everything allocated
+// since a "checkpoint", and the destructor releases everything, so an
+// arena declared in a scope frees its memory when the scope ends.  An
+// arena can be given an initial buffer (typically on the stack), so
+// that small amounts of scratch memory need no heap allocation at all.
+// An arena must only be used by one thread at a time.
+
+struct arena_chunk; // forward declaration
+
+class arena
+  {
+  public:
+
+    // largest chunk that fits in one page with the allocator's header
+    static const size_t default_chunk_size = 4080;
+
+    arena (size_t chunk_size = default_chunk_size);
+    arena (void* buf, size_t size, size_t chunk_size = default_chunk_size);
+    ~arena ();
+
+    void* alloc (size_t size); // 8 byte aligned, NULL if out of memory
+
+    typedef struct
+      {
+        arena_chunk* chunk;
+        uint8* ptr;
+      } mark;
+
+    mark checkpoint (); // current allocation point
+    void rewind (mark m); // frees what was allocated since checkpoint "m"
+    void release (); // frees everything
+
+  protected:
+
+    void* alloc_in_new_chunk (size_t size);
+
+    arena_chunk* _chunk; // most recent chunk (NULL for initial buffer)
+    uint8* _ptr;         // next free byte in current chunk
+    uint8* _limit;       // end of current chunk
+    uint8* _buf;         // initial buffer
+    uint8* _buf_limit;
+    size_t _chunk_size;
+  };
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
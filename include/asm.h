@@ -15,10 +15,99 @@
 
 //-----------------------------------------------------------------------------
 
+// Pointer to a fixed physical address.  The address goes through an
+// empty "asm" so that GCC does not take addresses in the first page
+// for offsets from a null pointer (which it reports as out of bounds).
+
+#define fixed_address(type,addr) \
+({ \
+   type ptr = CAST(type,addr); \
+   __asm__ ("" : "+r" (ptr)); \
+   ptr; \
+})
+
+// Prevent the compiler from moving memory accesses across this point.
+
+#define compiler_barrier() __asm__ __volatile__ ("" : : : "memory")
+
+// When "preempt_enable" (see "thread.h") is reached with interrupts
+// disabled the postponed work cannot be run, so it is run by the next
+// "enable_interrupts" or "restore_flags" which enables interrupts.
+// It must not wait for the next IRQ because the timer is only
+// re-armed by that work.
+
+extern volatile bool preempt_resume_pending;
+
+void preempt_resume ();
+
+#define run_pending_preempt_resume() \
+do { \
+     if (preempt_resume_pending) \
+       preempt_resume (); \
+   } while (0)
+
 // CPU interrupt enable/disable.
 
 #define disable_interrupts() __asm__ __volatile__ ("cli" : : : "memory")
-#define enable_interrupts() __asm__ __volatile__ ("sti" : : : "memory")
+#define enable_interrupts() \
+do { \
+     __asm__ __volatile__ ("sti" : : : "memory"); \
+     run_pending_preempt_resume (); \
+   } while (0)
+
+// Disable interrupts and return the previous state of the flags, so
+// that the previous interrupt state can be restored with
+// "restore_flags".  Used by code that can be called with interrupts
+// either enabled or disabled.
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+
+// The sections which disable interrupts with these macros are
+// profiled like the ones using "disable_interrupts" (see "intr.h"),
+// when they are the outermost section with interrupts disabled.
+
+void intr_off_begin (const char* file, int line);
+void intr_off_end ();
+
+#define save_flags_and_disable_interrupts() \
+({ \
+   uint32 val; \
+   __asm__ __volatile__ ("pushfl;popl %0;cli" : "=g" (val) : : "memory"); \
+   if (val & (1<<9)) \
+     intr_off_begin (__FILE__, __LINE__); \
+   val; \
+})
+
+#define restore_flags(flags) \
+do { \
+     uint32 restored = (flags); \
+     if (restored & (1<<9)) \
+       intr_off_end (); \
+     __asm__ __volatile__ ("pushl %0;popfl" : : "g" (restored) \
+                           : "memory", "cc"); \
+     if (restored & (1<<9)) \
+       run_pending_preempt_resume (); \
+   } while (0)
+
+#else
+
+#define save_flags_and_disable_interrupts() \
+({ \
+   uint32 val; \
+   __asm__ __volatile__ ("pushfl;popl %0;cli" : "=g" (val) : : "memory"); \
+   val; \
+})
+
+#define restore_flags(flags) \
+do { \
+     uint32 restored = (flags); \
+     __asm__ __volatile__ ("pushl %0;popfl" : : "g" (restored) \
+                           : "memory", "cc"); \
+     if (restored & (1<<9)) \
+       run_pending_preempt_resume (); \
+   } while (0)
+
+#endif
 
 //-----------------------------------------------------------------------------
 
@@ -45,6 +134,48 @@
    val; \
 })
 
+#define cr0_reg() \
+({ \
+   uint32 val; \
+   __asm__ __volatile__ ("movl %%cr0,%0" : "=r" (val)); \
+   val; \
+})
+
+#define cr2_reg() \
+({ \
+   uint32 val; \
+   __asm__ __volatile__ ("movl %%cr2,%0" : "=r" (val)); \
+   val; \
+})
+
+#define cr3_reg() \
+({ \
+   uint32 val; \
+   __asm__ __volatile__ ("movl %%cr3,%0" : "=r" (val)); \
+   val; \
+})
+
+#define set_cr0(x) __asm__ __volatile__ ("movl %0,%%cr0" : : "r" (x) : "memory")
+#define set_cr3(x) __asm__ __volatile__ ("movl %0,%%cr3" : : "r" (x) : "memory")
+#define set_cr4(x) __asm__ __volatile__ ("movl %0,%%cr4" : : "r" (x) : "memory")
+
+#define CR0_EM     (1<<2)  // Emulation (no FPU)
+#define CR0_TS     (1<<3)  // Task Switched
+#define CR0_NW     (1<<29) // Not Write-through
+#define CR0_CD     (1<<30) // Cache Disable
+#define CR0_PG     (1<<31) // Paging
+#define CR4_PSE    (1<<4)  // Page Size Extensions
+#define CR4_OSFXSR (1<<9)  // OS supports FXSAVE/FXRSTOR and SSE
+
+// Invalidate the TLB entry of the page containing an address.
+
+#define invlpg(addr) \
+__asm__ __volatile__ ("invlpg (%0)" : : "r" (addr) : "memory")
+
+// Load the task register.
+
+#define ltr(sel) __asm__ __volatile__ ("ltr %0" : : "r" (CAST(uint16,sel)))
+
 //-----------------------------------------------------------------------------
 
 // Access to the time stamp counter and performance monitoring counters.
@@ -82,6 +213,8 @@ __asm__ __volatile__ \
 #define HAS_ACC       (1<<29) // Automatic clock control
 #define HAS_IA64      (1<<30) // IA64 instructions
 
+#define HAS_X2APIC    (1<<21) // x2APIC mode (in %ecx, not %edx)
+
 #define wrmsr(msr,val) \
 __asm__ __volatile__ (".byte 0x0f,0x30" : : "A" (CAST(uint64,val)), "c" (msr))
 
@@ -124,6 +257,28 @@ __asm__ __volatile__ (".byte 0x0f,0x30" : : "A" (CAST(uint64,val)), "c" (msr))
 #define MSR_CTR0_REG 18
 #define MSR_CTR1_REG 19
 
+#define MSR_MTRRCAP           0xfe
+#define MSR_MTRR_PHYSBASE(n)  (0x200+2*(n))
+#define MSR_MTRR_PHYSMASK(n)  (0x201+2*(n))
+#define MSR_MTRR_FIX16K_A0000 0x259
+#define MSR_PAT               0x277
+#define MSR_MTRR_DEF_TYPE     0x2ff
+
+#define MTRRCAP_VCNT_MASK 0xff    // number of variable range MTRRs
+#define MTRRCAP_FIX       (1<<8)  // fixed range MTRRs supported
+#define MTRRCAP_WC        (1<<10) // write-combining type supported
+
+#define MTRR_DEF_TYPE_FE  (1<<10) // fixed range MTRRs enabled
+#define MTRR_DEF_TYPE_E   (1<<11) // MTRRs enabled
+#define MTRR_PHYSMASK_V   (1<<11) // variable range MTRR valid
+
+#define MEM_TYPE_UC       0 // uncacheable
+#define MEM_TYPE_WC       1 // write-combining
+#define MEM_TYPE_WT       4 // write-through
+#define MEM_TYPE_WP       5 // write-protected
+#define MEM_TYPE_WB       6 // write-back
+#define MEM_TYPE_UC_MINUS 7 // uncacheable, overridable by MTRRs (PAT only)
+
 #define CES_CONFIG(ctr0,ctr1) (((ctr1)<<16)+(ctr0))
 #define CES_SETTING(es,cc,pc) (((pc)<<9)+((cc)<<6)+(es))
 
@@ -157,7 +312,7 @@ __asm__ __volatile__ (".byte 0x0f,0x30" : : "A" (CAST(uint64,val)), "c" (msr))
 
 // Write-back and invalidate cache.
 
-#define wbinvd() __asm__ __volatile__ ("wbinvd")
+#define wbinvd() __asm__ __volatile__ ("wbinvd" : : : "memory")
 
 //-----------------------------------------------------------------------------
 
@@ -27,6 +27,9 @@ class fifo
     fifo ();
     virtual ~fifo ();
 
+    void* operator new (size_t size); // allocated from a pool
+    void operator delete (void* obj);
+
     void put (uint8 byte);  // write a byte to fifo
     void get (uint8* byte); // read a byte from fifo
     bool get_or_timeout (uint8* byte, time timeout);// like "get" but returns
@@ -94,17 +94,45 @@ typedef int32 error_code;
 
 #define USE_IRQ1_FOR_KEYBOARD
 
-// A thread's context can be restored with an "iret" instruction or a
-// "ret" instruction.  For some unexplained reason the latest AMD
-// Athlon processors cause an "invalid TSS" exception when the "iret"
-// instruction is used.
+// The master PIC can be initialized in automatic EOI mode so that
+// IRQ0 to IRQ7 need not be acknowledged (and IRQ8 to IRQ15 only need
+// to be acknowledged on the slave PIC).  This is safe because
+// "irq_dispatch" acknowledges an IRQ before calling its handlers
+// anyway, so the PIC's in-service bit never protects a handler.  The
+// HIGH priority handlers run with interrupts disabled, and before a
+// LOW or NORMAL priority handler enables interrupts the IRQs of the
+// same and lower priorities (including its own) are masked in the
+// PICs, so the IRQ can't be delivered again while it is handled.
+
+//#define USE_PIC_AUTO_EOI
+
+// External IRQs can be routed through the I/O APIC instead of the
+// PICs, in which case they are acknowledged with a single write to
+// the local APIC.  The PICs are still used if no I/O APIC is found.
+
+//#define USE_IOAPIC_FOR_IRQS
+
+#if defined(USE_APIC_FOR_TIMER) || defined(USE_IOAPIC_FOR_IRQS)
+#define USE_LOCAL_APIC
+#endif
+
+// When the CPU supports it, the local APIC is put in x2APIC mode and
+// its registers are accessed with "rdmsr"/"wrmsr" instead of memory
+// mapped I/O.
 
-//#define USE_IRET_FOR_RESTORE_CONTEXT
-#define USE_RET_FOR_RESTORE_CONTEXT
+#ifdef USE_LOCAL_APIC
+#define USE_X2APIC
+#endif
 
 //#define SHOW_INTERRUPTS
 //#define SHOW_TIMER_INTERRUPTS
 //#define CHECK_ASSERTIONS
+//#define SHOW_MEM_INFO
+//#define SHOW_VIDEO_BENCHMARK
+//#define SHOW_CONTEXT_SWITCH_BENCHMARK
+//#define INSTRUMENT_HEAP
+//#define CHECK_STACK_CANARY
+//#define PROFILE_INTERRUPTS_DISABLED
 
 //-----------------------------------------------------------------------------
 
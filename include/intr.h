@@ -16,35 +16,66 @@
 #include "pic.h"
 #include "apic.h"
 
+#ifdef USE_IOAPIC_FOR_IRQS
+#include "ioapic.h"
+#endif
+
 //-----------------------------------------------------------------------------
 
 // Initialization of interrupt manager.
 
 void setup_intr ();
 
-// Enabling, disabling and acknowledging IRQs.
+// IRQ "n" is delivered to interrupt vector IRQ0_VECTOR+n (this must
+// match "kernel.s").
 
-#define ENABLE_IRQ(n) \
+#define IRQ0_VECTOR 0xb0
+
+// Enabling, disabling and acknowledging IRQs.  The PIC masks are
+// kept in memory so that changing them takes a single port write.
+
+// While the handler of a low priority IRQ runs, the IRQs of the same
+// or lower priority are masked as well ("irq_priority_mask").
+
+extern volatile uint8 pic_master_mask;
+extern volatile uint8 pic_slave_mask;
+extern volatile uint16 irq_priority_mask;
+
+#define PIC_ENABLE_IRQ(n) \
 do { \
      if ((n) < 8) \
-       outb (inb (PIC_PORT_MASTER_IMR) & ~PIC_OCW1_MASK(n), \
+       outb ((pic_master_mask &= ~PIC_OCW1_MASK(n)) \
+             | CAST(uint8,irq_priority_mask), \
              PIC_PORT_MASTER_OCW1); \
      else \
-       outb (inb (PIC_PORT_SLAVE_IMR) & ~PIC_OCW1_MASK((n)-8), \
+       outb ((pic_slave_mask &= ~PIC_OCW1_MASK((n)-8)) \
+             | CAST(uint8,irq_priority_mask >> 8), \
              PIC_PORT_SLAVE_OCW1); \
    } while (0)
 
-#define DISABLE_IRQ(n) \
+#define PIC_DISABLE_IRQ(n) \
 do { \
      if ((n) < 8) \
-       outb (inb (PIC_PORT_MASTER_IMR) | PIC_OCW1_MASK(n), \
+       outb ((pic_master_mask |= PIC_OCW1_MASK(n)) \
+             | CAST(uint8,irq_priority_mask), \
              PIC_PORT_MASTER_OCW1); \
      else \
-       outb (inb (PIC_PORT_SLAVE_IMR) | PIC_OCW1_MASK((n)-8), \
+       outb ((pic_slave_mask |= PIC_OCW1_MASK((n)-8)) \
+             | CAST(uint8,irq_priority_mask >> 8), \
              PIC_PORT_SLAVE_OCW1); \
    } while (0)
 
-#define ACKNOWLEDGE_IRQ(n) \
+#ifdef USE_PIC_AUTO_EOI
+
+#define PIC_ACKNOWLEDGE_IRQ(n) \
+do { \
+     if ((n) >= 8) \
+       outb (PIC_OCW2_SPECIFIC_EOI((n)-8), PIC_PORT_SLAVE_OCW2); \
+   } while (0)
+
+#else
+
+#define PIC_ACKNOWLEDGE_IRQ(n) \
 do { \
      if ((n) < 8) \
        outb (PIC_OCW2_SPECIFIC_EOI(n), PIC_PORT_MASTER_OCW2); \
@@ -55,27 +86,162 @@ do { \
        } \
    } while (0)
 
+#endif
+
+#ifdef USE_IOAPIC_FOR_IRQS
+
+#define ENABLE_IRQ(n) \
+do { \
+     if (irqs_use_ioapic) \
+       ioapic_unmask_irq (n); \
+     else \
+       PIC_ENABLE_IRQ(n); \
+   } while (0)
+
+#define DISABLE_IRQ(n) \
+do { \
+     if (irqs_use_ioapic) \
+       ioapic_mask_irq (n); \
+     else \
+       PIC_DISABLE_IRQ(n); \
+   } while (0)
+
+#define ACKNOWLEDGE_IRQ(n) \
+do { \
+     if (irqs_use_ioapic) \
+       APIC_EOI = 0; \
+     else \
+       PIC_ACKNOWLEDGE_IRQ(n); \
+   } while (0)
+
+#else
+
+#define ENABLE_IRQ(n) PIC_ENABLE_IRQ(n)
+#define DISABLE_IRQ(n) PIC_DISABLE_IRQ(n)
+#define ACKNOWLEDGE_IRQ(n) PIC_ACKNOWLEDGE_IRQ(n)
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// IRQ handlers.
+//
+// Several handlers can be registered for the same IRQ (shared
+// interrupts), in which case they are called in the order in which
+// they were registered.  The IRQ is acknowledged before the handlers
+// are called because the interrupted thread may be preempted before
+// the end of the IRQ (when the timer signals the end of the quantum).
+
+#define NB_IRQS 16
+#define NB_IRQ_HANDLERS 32 // maximum number of registered handlers
+
+typedef void (*irq_handler) (void* arg);
+
+bool register_irq_handler (int irq, irq_handler fn, void* arg);
+void unregister_irq_handler (int irq, irq_handler fn, void* arg);
+uint32 irq_count (int irq); // number of times the IRQ occurred
+
+// IRQ priorities.
+//
+// The handlers of IRQ_PRIO_HIGH IRQs (the default) run with
+// interrupts disabled, so they must be short.  The handlers of lower
+// priority IRQs run with interrupts enabled, but with the IRQs of the
+// same or lower priority masked (with the task priority register of
+// the local APIC when the I/O APIC is used, otherwise with the PIC
+// masks), so that they can only be interrupted by higher priority
+// IRQs.  Since an IRQ can't interrupt a handler of its own priority,
+// at most one handler per priority is on the stack at any time.
+
+#define IRQ_PRIO_LOW    0
+#define IRQ_PRIO_NORMAL 1
+#define IRQ_PRIO_HIGH   2
+#define NB_IRQ_PRIOS    3
+
+void set_irq_priority (int irq, int prio); // call after "setup_intr"
+
+// Deferred work ("bottom halves").
+//
+// IRQ handlers run with interrupts disabled, so they should only do
+// what is urgent (reading a device register, acknowledging a device)
+// and queue the rest with "defer_work".  The deferred work runs at
+// the end of the IRQ, in the order it was queued, with interrupts
+// enabled.  A work item queued again before it has run only runs
+// once.  Deferred work is not reentrant: an IRQ which occurs while
+// deferred work is running only queues its own work, which is run by
+// the outer IRQ.  Deferred work runs with preemption disabled, and
+// an IRQ which occurs while preemption is disabled leaves its work to
+// "preempt_enable".  There is a single list because there is one CPU.
+
+struct deferred_work
+  {
+    void (*fn) (void* arg);
+    void* arg;
+    deferred_work* next;
+    bool queued;
+  };
+
+#define DEFERRED_WORK(fn,arg) { fn, arg, NULL, FALSE }
+
+void defer_work (deferred_work* w); // interrupts must be disabled
+void irq_exit (); // runs the deferred work and preempts if needed
+
+// runs the deferred work and returns TRUE if the interrupted thread
+// must be preempted (must be called on the interrupt stack)
+extern "C" bool run_deferred_work ();
+
+// calls "run_deferred_work" on the interrupt stack (see "kernel.s")
+extern "C" bool run_deferred_work_on_irq_stack ();
+
+extern deferred_work* volatile deferred_head; // NULL when no work is queued
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+
+// Profiling of the time spent with interrupts disabled.  For each
+// place where interrupts are disabled (and for IRQ handlers) the
+// number of times, the total and maximum number of cycles and a
+// histogram of the duration (bucket "i" counts durations from 2^i to
+// 2^(i+1)-1 cycles) are kept.  A section which starts in one thread
+// and ends in another (because of a context switch) is attributed to
+// the place where it started.
+
+void intr_off_begin (const char* file, int line);
+void intr_off_end ();
+void report_intr_off (); // shows the statistics of all places
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Interrupt stack.
+//
+// The IRQ trampolines in "kernel.s" switch to a dedicated stack when
+// an IRQ interrupts a thread, so the thread stacks don't need room
+// for the frames of the IRQ handlers and deferred work.  Nested IRQs
+// stay on the interrupt stack.  The deferred work run by
+// "preempt_enable" on a thread stack also switches to it (see
+// "irq_exit").  Context switches can't be done on the
+// interrupt stack, so the trampolines go back to the thread stack
+// before preempting the thread.  The registers pushed on the thread
+// stack on IRQ entry are the ones a context switch saves, so the
+// preemption only adds the rest of the "save_context" frame to them.
+// There is a single interrupt stack because there is one CPU.
+
+#define IRQ_STACK_SIZE 16384 // size of the interrupt stack in bytes
+
+extern "C" uint32* irq_stack_top;  // initial stack pointer
+extern "C" uint32 irq_stack_depth; // number of IRQs using the stack
+
 //-----------------------------------------------------------------------------
 
-// Interrupt handlers must use C linkage.
-
-extern "C" void irq0 ();
-extern "C" void irq1 ();
-extern "C" void irq2 ();
-extern "C" void irq3 ();
-extern "C" void irq4 ();
-extern "C" void irq5 ();
-extern "C" void irq6 ();
-extern "C" void irq7 ();
-extern "C" void irq8 ();
-extern "C" void irq9 ();
-extern "C" void irq10 ();
-extern "C" void irq11 ();
-extern "C" void irq12 ();
-extern "C" void irq13 ();
-extern "C" void irq14 ();
-extern "C" void irq15 ();
-extern "C" void APIC_timer_irq ();
+// Interrupt handlers must use C linkage.  The handlers called by the
+// trampolines return TRUE when the interrupted thread must be
+// preempted, which is done by "irq_preempt" on the thread stack.
+
+extern "C" bool irq_dispatch (int irq);
+extern "C" void irq_preempt (uint32 cs, uint32 eflags, uint32* sp,
+                             void* dummy);
+extern "C" void irq_resume_thread ();
+extern "C" bool APIC_timer_irq ();
 extern "C" void APIC_spurious_irq ();
 extern "C" void unhandled_interrupt (int num);
 
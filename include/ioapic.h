@@ -0,0 +1,59 @@
+// file: "ioapic.h"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+#ifndef __IOAPIC_H
+#define __IOAPIC_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+//
+// Definitions for the I/O APIC (82093AA and compatibles).
+//
+
+#define IOAPIC_DEFAULT_BASE 0xfec00000
+
+#define IOAPIC_IOREGSEL 0x00 // offsets of the memory mapped registers
+#define IOAPIC_IOWIN    0x10
+
+#define IOAPIC_ID       0x00 // indirect registers
+#define IOAPIC_VER      0x01
+#define IOAPIC_REDTBL(n) (0x10+2*(n))
+
+#define IOAPIC_VER_MAX_REDIR(x) (((x) >> 16) & 0xff)
+
+#define IOAPIC_REDIR_MASKED  (1<<16)
+#define IOAPIC_REDIR_LEVEL   (1<<15)
+#define IOAPIC_REDIR_LOW     (1<<13)
+#define IOAPIC_REDIR_LOGICAL (1<<11)
+#define IOAPIC_REDIR_FIXED   (0<<8)
+#define IOAPIC_REDIR_DEST(apic_id) (CAST(uint32,apic_id) << 24) // high word
+
+// The I/O APIC is found with the MP configuration table or, failing
+// that, with the ACPI MADT.  "setup_ioapic" routes the ISA IRQs 0 to
+// 15 (taking into account the interrupt source overrides) to the
+// vectors used with the PICs, with all IRQs masked, and returns FALSE
+// if there is no I/O APIC.
+
+bool setup_ioapic ();
+void ioapic_mask_irq (int irq);
+void ioapic_unmask_irq (int irq);
+void ioapic_set_vector (int irq, uint32 vector); // vector of IRQ's interrupt
+
+extern bool irqs_use_ioapic; // TRUE once "setup_ioapic" has succeeded
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
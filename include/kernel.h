@@ -19,6 +19,26 @@ extern "C" {
 
 // No functions are currently exported by "kernel.s".
 
+// Physical memory map obtained from the BIOS at boot (INT 15h,
+// function E820h).
+
+typedef struct mem_map_entry
+  {
+    uint64 base;
+    uint64 length;
+    uint32 type;
+    uint32 acpi_attributes;
+  } mem_map_entry;
+
+#define MEM_MAP_USABLE           1
+#define MEM_MAP_RESERVED         2
+#define MEM_MAP_ACPI_RECLAIMABLE 3
+#define MEM_MAP_ACPI_NVS         4
+#define MEM_MAP_BAD              5
+
+extern mem_map_entry mem_map[];
+extern uint32 mem_map_count;
+
 //-----------------------------------------------------------------------------
 
 };
@@ -0,0 +1,67 @@
+// file: "page.h"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+#ifndef __PAGE_H
+#define __PAGE_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+// Physical page allocator.  Only the memory which the BIOS reports as
+// usable RAM above 1MB is handed out, using a binary buddy allocator.
+// "alloc_pages" returns the address of "npages" free contiguous pages
+// (at most 2^PAGE_MAX_ORDER) or NULL if there is no such run, and
+// "free_pages" must be given the same number of pages that was
+// allocated.  Both functions can be called with interrupts enabled or
+// disabled.
+
+#define PAGE_SIZE 4096
+#define PAGE_MAX_ORDER 12 // largest block is 16MB
+
+void setup_pages ();
+void* alloc_pages (uint32 npages);
+void free_pages (void* ptr, uint32 npages);
+
+extern uint32 _ram_kb;       // RAM reported by the BIOS, in KB
+extern uint32 _usable_pages; // pages managed by the page allocator
+extern uint32 _free_pages;   // pages currently free
+extern uint32 _free_blocks[PAGE_MAX_ORDER+1]; // free blocks of each order
+
+// Fragmentation statistics.
+
+uint32 largest_free_block (); // in pages
+uint32 page_fragmentation (); // in percent
+void report_pages ();
+
+// Paging.  All of the 4GB physical address space is identity mapped,
+// with 4MB pages when the CPU supports them.  Individual 4KB pages can
+// be made not present, for example to catch stack overflows with a
+// guard page (the enclosing 4MB page is then split into 4KB pages).
+
+#define PAGE_DIR 0x1000 // physical address of page directory (see "kernel.s")
+
+void setup_paging ();
+void set_page_present (void* ptr, bool present);
+bool page_present (void* ptr);
+
+// Make a region of physical memory write-combining, using the page
+// attribute table when the CPU has one and the MTRRs otherwise.
+// Returns FALSE if the CPU can't do it for this region.
+
+bool set_write_combining (void* ptr, uint32 size);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
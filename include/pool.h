@@ -0,0 +1,118 @@
+// file: "pool.h"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+#ifndef __POOL_H
+#define __POOL_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+#include "asm.h"
+
+//-----------------------------------------------------------------------------
+
+// "object_pool" class declaration.
+//
+// An object pool holds storage for N objects of type T in a static
+// array.  Slots which were never used are handed out in order and
+// released slots are kept on an intrusive free list (the link is
+// stored in the slot itself), so "allocate" and "release" take
+// constant time.  When CACHE_ALIGNED is TRUE each slot is aligned on,
+// and padded to, a cache line so that objects never share a line.
+//
+// The pool has no constructor: a pool with static storage duration is
+// in the BSS, which is zeroed before any constructor runs, so a pool
+// can be used by the constructors of global objects.  Both operations
+// disable interrupts briefly and can be used from interrupt handlers.
+//
+// A class uses a pool by defining its own "operator new" and "operator
+// delete", falling back on the general heap when the pool is full or
+// for objects of a derived class:
+//
+//   static object_pool<foo, 32, TRUE> foo_pool;
+//
+//   void* foo::operator new (size_t size)
+//   {
+//     void* obj = foo_pool.allocate (size);
+//     return (obj != NULL) ? obj : ::operator new (size);
+//   }
+//
+//   void foo::operator delete (void* obj)
+//   {
+//     if (!foo_pool.release (obj))
+//       ::operator delete (obj);
+//   }
+
+#define CACHE_LINE_SIZE 64
+
+template <class T, int N, bool CACHE_ALIGNED = FALSE>
+class object_pool
+  {
+  public:
+
+    // Returns a slot for an object of "size" bytes, or NULL if the
+    // pool is full or the object is not a T.
+
+    void* allocate (size_t size = sizeof (T))
+      {
+        if (size != sizeof (T))
+          return NULL;
+
+        uint32 flags = save_flags_and_disable_interrupts ();
+        void* obj = _free_list;
+
+        if (obj != NULL)
+          _free_list = *CAST(void**,obj);
+        else if (_never_used < N)
+          obj = _slots[_never_used++];
+
+        restore_flags (flags);
+
+        return obj;
+      }
+
+    // Returns the slot of "obj" to the pool.  Returns FALSE (and does
+    // nothing) if "obj" is not in the pool.
+
+    bool release (void* obj)
+      {
+        if (!contains (obj))
+          return FALSE;
+
+        uint32 flags = save_flags_and_disable_interrupts ();
+
+        *CAST(void**,obj) = _free_list;
+        _free_list = obj;
+
+        restore_flags (flags);
+
+        return TRUE;
+      }
+
+    bool contains (void* obj)
+      {
+        return CAST(uint8*,obj) >= _slots[0] && CAST(uint8*,obj) < _slots[N];
+      }
+
+  protected:
+
+    static const size_t align = CACHE_ALIGNED ? CACHE_LINE_SIZE : 8;
+    static const size_t slot_size = (sizeof (T) + align - 1) & ~(align - 1);
+
+    uint8 _slots[N][slot_size] __attribute__ ((aligned (align)));
+    void* _free_list;
+    int _never_used; // index of first slot never allocated
+  };
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -1,100 +1,272 @@
-/* file: "queue.h" */
+// file: "queue.h"
 
-/*
- * Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
- * Rights Reserved.
- *
- * Revision History
- * 02 Nov 01  initial version (Marc Feeley)
- */
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 02 Nov 01  initial version (Marc Feeley)
+// 18 Oct 26  templates instead of macro instantiation
 
-/*
- * This file is normally included with "#include" to generate a set of
- * queue routines.  It should be included once for every set of queue
- * routines that is needed.  In C++ we would normally use templates to
- * achieve this goal, but in C the "#include" approach is required.
- * Just before including the file the following macros must be
- * defined:
- *
- *   NODETYPE                the base type for the queue and its elements
- *   QUEUETYPE               the NODETYPE subtype for the queue
- *   ELEMTYPE                the NODETYPE subtype for the elements of the queue
- *   NAMESPACE_PREFIX(name)  creates a prefixed name to avoid name clashes
- *
- *   BEFORE(elem1,elem2)      are elem1 and elem2 in order?
- *   NEXT(node)               the next node
- *   NEXT_SET(node,next_node) set the next node
- *   PREV(node)               the previous node
- *   PREV_SET(node,prev_node) set the previous node
- */
+#ifndef __QUEUE_H
+#define __QUEUE_H
 
-/*---------------------------------------------------------------------------*/
+//-----------------------------------------------------------------------------
 
-#ifdef USE_DOUBLY_LINKED_LIST
+#include "general.h"
 
-/*
- * Priority queue implementation using doubly-linked lists.
- */
+//-----------------------------------------------------------------------------
 
+// Intrusive queues.
+//
+// The links of a queue are fields of the nodes, and the queue itself
+// is a node which serves as the sentinel of a circular list.  A queue
+// is described by the type of its nodes ("NODE"), of the queue
+// ("QUEUE") and of its elements ("ELEM"), which are subtypes of NODE,
+// by pointers to the link fields of NODE and by an ordering class
+// "ORDER" whose static "before" function tells if two elements are in
+// order.  An element is inserted after all the elements it is not
+// before, so "fifo_order" gives a FIFO queue.  The functions are
+// inline so each operation is specialized for its queue.
+//
+// The links are not volatile.  The queues are only accessed with
+// preemption disabled, and "preempt_disable", "preempt_enable" and
+// the context switches are compiler barriers, so the compiler can
+// keep the links in registers within an operation.
 
-inline void NAMESPACE_PREFIX(init) (QUEUETYPE* queue)
-{
-  NEXT_SET (CAST(NODETYPE*,queue), CAST(NODETYPE*,queue));
-  PREV_SET (CAST(NODETYPE*,queue), CAST(NODETYPE*,queue));
-}
+template <class ELEM>
+class fifo_order
+  {
+  public:
 
+    static bool before (ELEM* elem1, ELEM* elem2) { return FALSE; }
+  };
 
-inline void NAMESPACE_PREFIX(detach) (ELEMTYPE* elem)
-{
-  NEXT_SET (CAST(NODETYPE*,elem), CAST(NODETYPE*,elem));
-  PREV_SET (CAST(NODETYPE*,elem), CAST(NODETYPE*,elem));
-}
+//-----------------------------------------------------------------------------
 
+// Queues using doubly-linked lists.  All operations are constant time
+// except "insert" in an ordered queue, which scans from the tail.
 
-inline ELEMTYPE* NAMESPACE_PREFIX(head) (QUEUETYPE* queue)
-{
-  NODETYPE* head = NEXT (CAST(NODETYPE*,queue));
+template <class NODE, class QUEUE, class ELEM,
+          NODE* NODE::*NEXT, NODE* NODE::*PREV, class ORDER>
+class doubly_linked_queue
+  {
+  public:
 
-  if (head != CAST(NODETYPE*,queue))
-    return CAST(ELEMTYPE*,head);
+    static void init (QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        q->*NEXT = q;
+        q->*PREV = q;
+      }
 
-  return NULL;
-}
+    static void detach (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        e->*NEXT = e;
+        e->*PREV = e;
+      }
 
+    static ELEM* head (QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        NODE* h = q->*NEXT;
 
-inline void NAMESPACE_PREFIX(insert) (ELEMTYPE* elem, QUEUETYPE* queue)
-{
-  NODETYPE* node2 = CAST(NODETYPE*,queue);
-  NODETYPE* node1 = PREV (node2);
+        if (h != q)
+          return CAST(ELEM*,h);
 
-  while (node1 != CAST(NODETYPE*,queue) &&
-         BEFORE (elem, CAST(ELEMTYPE*,node1)))
-    {
-      node2 = node1;
-      node1 = PREV (node2);
-    }
+        return NULL;
+      }
 
-  // insert elem between node1 and node2
+    static void insert (ELEM* elem, QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        NODE* e = CAST(NODE*,elem);
+        NODE* node2 = q;
+        NODE* node1 = node2->*PREV;
 
-  NEXT_SET (node1, CAST(NODETYPE*,elem));
-  PREV_SET (CAST(NODETYPE*,elem), node1);
+        while (node1 != q && ORDER::before (elem, CAST(ELEM*,node1)))
+          {
+            node2 = node1;
+            node1 = node2->*PREV;
+          }
 
-  NEXT_SET (CAST(NODETYPE*,elem), node2);
-  PREV_SET (node2, CAST(NODETYPE*,elem));
-}
+        // insert elem between node1 and node2
 
+        node1->*NEXT = e;
+        e->*PREV = node1;
+        e->*NEXT = node2;
+        node2->*PREV = e;
+      }
 
-inline void NAMESPACE_PREFIX(remove) (ELEMTYPE* elem)
-{
-  NODETYPE* prev_node = PREV (CAST(NODETYPE*,elem));
-  NODETYPE* next_node = NEXT (CAST(NODETYPE*,elem));
+    static void remove (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        NODE* prev_node = e->*PREV;
+        NODE* next_node = e->*NEXT;
 
-  NEXT_SET (prev_node, next_node);
-  PREV_SET (next_node, prev_node);
-}
+        prev_node->*NEXT = next_node;
+        next_node->*PREV = prev_node;
+      }
+  };
 
+//-----------------------------------------------------------------------------
 
-#endif
+// Queues using singly-linked lists.  They need half the links and
+// half the link updates, but "insert" and "remove" take a time
+// proportional to the length of the queue, even in FIFO order:
+// "insert" scans from the head and "remove" goes around the circle to
+// find the predecessor (a tail pointer would only help "insert").
+// They are meant for short queues.
+
+template <class NODE, class QUEUE, class ELEM,
+          NODE* NODE::*NEXT, class ORDER>
+class singly_linked_queue
+  {
+  public:
+
+    static void init (QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        q->*NEXT = q;
+      }
+
+    static void detach (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        e->*NEXT = e;
+      }
+
+    static ELEM* head (QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        NODE* h = q->*NEXT;
+
+        if (h != q)
+          return CAST(ELEM*,h);
+
+        return NULL;
+      }
+
+    static void insert (ELEM* elem, QUEUE* queue)
+      {
+        NODE* q = CAST(NODE*,queue);
+        NODE* e = CAST(NODE*,elem);
+        NODE* node1 = q;
+        NODE* node2 = node1->*NEXT;
+
+        while (node2 != q && !ORDER::before (elem, CAST(ELEM*,node2)))
+          {
+            node1 = node2;
+            node2 = node1->*NEXT;
+          }
+
+        // insert elem between node1 and node2
+
+        e->*NEXT = node2;
+        node1->*NEXT = e;
+      }
+
+    static void remove (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        NODE* prev_node = e;
+
+        while (prev_node->*NEXT != e)
+          prev_node = prev_node->*NEXT;
+
+        prev_node->*NEXT = e->*NEXT;
+      }
+  };
+
+//-----------------------------------------------------------------------------
+
+// Queues of elements with a small number of priority levels, using
+// doubly-linked lists.  The elements are in decreasing order of level
+// and in FIFO order within a level.  "LEVEL::level" gives the level of
+// an element (from 0 to NB_LEVELS-1) and the QUEUE must have a member
+// "NODE _level_end[NB_LEVELS]".  These nodes mark the end of each
+// level in the list, so "insert" and "remove" are constant time and
+// "head" skips at most NB_LEVELS markers.
 
+template <class NODE, class QUEUE, class ELEM,
+          NODE* NODE::*NEXT, NODE* NODE::*PREV,
+          class LEVEL, int NB_LEVELS>
+class leveled_queue
+  {
+  public:
+
+    static void init (QUEUE* queue)
+      {
+        NODE* node1 = CAST(NODE*,queue);
+
+        for (int i=NB_LEVELS-1; i>=0; i--)
+          {
+            NODE* node2 = &queue->_level_end[i];
+            node1->*NEXT = node2;
+            node2->*PREV = node1;
+            node1 = node2;
+          }
+
+        node1->*NEXT = CAST(NODE*,queue);
+        CAST(NODE*,queue)->*PREV = node1;
+      }
+
+    static void detach (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        e->*NEXT = e;
+        e->*PREV = e;
+      }
+
+    static ELEM* head (QUEUE* queue)
+      {
+        // The level end markers are in the order of decreasing level,
+        // so the next node is either the next marker or an element.
+
+        NODE* q = CAST(NODE*,queue);
+        NODE* h = q->*NEXT;
+        int level = NB_LEVELS-1;
+
+        while (h != q)
+          {
+            if (h != &queue->_level_end[level])
+              return CAST(ELEM*,h);
+            level--;
+            h = h->*NEXT;
+          }
+
+        return NULL;
+      }
+
+    static void insert (ELEM* elem, QUEUE* queue)
+      {
+        NODE* e = CAST(NODE*,elem);
+        NODE* node2 = &queue->_level_end[LEVEL::level (elem)];
+        NODE* node1 = node2->*PREV;
+
+        // insert elem between node1 and node2
+
+        node1->*NEXT = e;
+        e->*PREV = node1;
+        e->*NEXT = node2;
+        node2->*PREV = e;
+      }
+
+    static void remove (ELEM* elem)
+      {
+        NODE* e = CAST(NODE*,elem);
+        NODE* prev_node = e->*PREV;
+        NODE* next_node = e->*NEXT;
+
+        prev_node->*NEXT = next_node;
+        next_node->*PREV = prev_node;
+      }
+  };
+
+//-----------------------------------------------------------------------------
+
+#endif
 
-/*---------------------------------------------------------------------------*/
+// Local Variables: //
+// mode: C++ //
+// End: //
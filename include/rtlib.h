@@ -21,6 +21,12 @@ void fatal_error (native_string msg);
 
 //-----------------------------------------------------------------------------
 
+// CPU identification.
+
+extern uint32 _cpu_features; // "cpuid" feature flags (see "asm.h")
+
+//-----------------------------------------------------------------------------
+
 // Math routines.
 
 uint8 log2 (uint32 n);
@@ -30,11 +36,22 @@ uint8 log2 (uint32 n);
 // Memory management.
 
 void* kmalloc (size_t size);
+void* kmalloc_at (size_t size, void* caller); // "caller" is the call site
 void kfree (void* ptr);
 
+#ifdef INSTRUMENT_HEAP
+void heap_report (); // shows live objects per allocation site
+#endif
+
 extern "C"
 void* memcpy (void* dest, const void* src, size_t n);
 
+extern "C"
+void* memset (void* dest, int c, size_t n);
+
+extern "C"
+void* memmove (void* dest, const void* src, size_t n);
+
 //-----------------------------------------------------------------------------
 
 // Execution of global constructors and destructors.
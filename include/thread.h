@@ -14,6 +14,7 @@
 #include "general.h"
 #include "intr.h"
 #include "time.h"
+#include "queue.h"
 
 //-----------------------------------------------------------------------------
 
@@ -44,19 +45,60 @@ do { \
 
 #endif
 
+#ifdef PROFILE_INTERRUPTS_DISABLED
+
+// Each section of code with interrupts disabled is timed and
+// attributed to the place where interrupts were disabled.
+
 #define disable_interrupts() \
 do { \
      ASSERT_INTERRUPTS_ENABLED (); \
      __asm__ __volatile__ ("cli" : : : "memory"); \
+     intr_off_begin (__FILE__, __LINE__); \
    } while (0)
 
 #define enable_interrupts() \
 do { \
      ASSERT_INTERRUPTS_DISABLED (); \
+     intr_off_end (); \
      __asm__ __volatile__ ("sti" : : : "memory"); \
+     run_pending_preempt_resume (); \
+   } while (0)
+
+#else
+
+#define disable_interrupts() \
+do { \
+     ASSERT_INTERRUPTS_ENABLED (); \
+     __asm__ __volatile__ ("cli" : : : "memory"); \
    } while (0)
 
+#define enable_interrupts() \
+do { \
+     ASSERT_INTERRUPTS_DISABLED (); \
+     __asm__ __volatile__ ("sti" : : : "memory"); \
+     run_pending_preempt_resume (); \
+   } while (0)
+
+#endif
+
 // Save and restore the CPU state.
+//
+// The context of a suspended thread is a stack pointer which points
+// to the address where the thread resumes, so a context is restored
+// with a "ret".  There are two ways to save the context.  A voluntary
+// context switch (yield, blocking on a mutex or condition variable,
+// sleeping) happens at a function call boundary, so only the
+// registers which are live across the call need saving:
+// "save_minimal_context" declares the other registers as clobbered,
+// so the compiler only preserves the ones it uses, and it saves %ebp
+// (which can't be declared clobbered).  "save_context" saves all the
+// registers; it is used where the state of the interrupted code is
+// unknown.  The IRQ trampolines in "kernel.s" save the context of a
+// preempted thread in the same format as "save_context".  In all
+// cases the receiver function is called with interrupts disabled and
+// with the stack pointer of the saved context as its third parameter
+// (the "cs" and "eflags" parameters are unused).
 
 #define save_context(receiver,data)                                           \
 do {                                                                          \
@@ -66,47 +108,116 @@ do {                                                                          \
          pushl %1               # The fourth parameter of the receiver fn  \n \
          lea   -16(%%esp),%%eax # The third parameter of the receiver fn   \n \
          pushl %%eax                                                       \n \
-         pushfl                 # Setup a stack frame with the same format \n \
-         pushl %%cs             #  as expected by the ``iret'' instruction \n \
-         call  %c0              #  so that ``iret'' can restore the context\n \
-         addl  $8,%%esp         # Remove the third and fourth parameter    \n \
+         pushfl                 # The second parameter of the receiver fn  \n \
+         pushl %%cs             # The first parameter of the receiver fn   \n \
+         call  %c0              # The ``ret'' in ``restore_context'' comes \n \
+         addl  $16,%%esp        #  back here; remove the parameters        \n \
          popal"                                                               \
         :                                                                     \
         : "i" (receiver), "g" (data)                                          \
         : "memory");                                                          \
    } while (0)
 
-#ifdef USE_IRET_FOR_RESTORE_CONTEXT
-
-#define restore_context(sp)                                                   \
+#define save_minimal_context(receiver,data)                                   \
 do {                                                                          \
      ASSERT_INTERRUPTS_DISABLED ();                                           \
      __asm__ __volatile__                                                     \
-       ("movl  %0,%%esp  # Restore the stack pointer                       \n \
-         iret            # Return from the ``call'' in ``save_context''"      \
+       ("movl  %1,%%eax                                                    \n \
+         pushl %%ebp                                                       \n \
+         pushl %%eax            # The fourth parameter of the receiver fn  \n \
+         lea   -16(%%esp),%%eax # The third parameter of the receiver fn   \n \
+         pushl %%eax                                                       \n \
+         subl  $8,%%esp         # The unused first and second parameters   \n \
+         call  %c0              # The ``ret'' in ``restore_context'' comes \n \
+         addl  $16,%%esp        #  back here; remove the parameters        \n \
+         popl  %%ebp"                                                         \
         :                                                                     \
-        : "g" (sp));                                                          \
+        : "i" (receiver), "g" (data)                                          \
+        : "eax", "ebx", "ecx", "edx", "esi", "edi", "cc", "memory");         \
    } while (0)
 
-#endif
-
-#ifdef USE_RET_FOR_RESTORE_CONTEXT
-
 #define restore_context(sp)                                                   \
 do {                                                                          \
      ASSERT_INTERRUPTS_DISABLED ();                                           \
      __asm__ __volatile__                                                     \
        ("movl  %0,%%esp  # Restore the stack pointer                       \n \
-         popl  %%ebx     # Get return address                              \n \
-         popl  %%eax     # Discard %%cs                                    \n \
-         popfl                                                             \n \
-         jmp   *%%ebx    # Return from the ``call'' in ``save_context''"      \
+         ret             # Return from the ``call'' in the saving code"       \
         :                                                                     \
         : "g" (sp));                                                          \
    } while (0)
 
+//-----------------------------------------------------------------------------
+
+// Preemption control.
+//
+// The scheduler's queues are protected by disabling preemption rather
+// than interrupts, so that IRQs keep being serviced while a thread
+// manipulates them.  While "preempt_count" is nonzero the deferred
+// work (including the timer's bottom half which wakes up sleeping
+// threads) and the preemptive context switches are postponed; they
+// are done when the count returns to 0.  Interrupts are only disabled
+// for the context switch itself.  There is a single count because
+// there is one CPU.
+//
+// The count is not saved with the thread's context, so every context
+// switch must happen with a count of exactly 1 (the resumed thread
+// does the single "preempt_enable" matching the one of the switch).
+// A thread must not block inside nested "preempt_disable" sections.
+
+extern volatile uint32 preempt_count;
+
+#define preempt_disable() \
+do { \
+     preempt_count++; \
+     compiler_barrier (); \
+   } while (0)
+
+#define preempt_enable() \
+do { \
+     compiler_barrier (); \
+     if (--preempt_count == 0 && deferred_head != NULL) \
+       preempt_resume (); \
+   } while (0)
+
+#ifdef CHECK_ASSERTIONS
+
+#define ASSERT_PREEMPT_DISABLED() \
+do { \
+     if (preempt_count == 0) \
+       { \
+         cout << __FILE__ << ":" << __LINE__ \
+              << ", failed ASSERT_PREEMPT_DISABLED\n"; \
+       } \
+   } while (0)
+
+#define ASSERT_PREEMPT_COUNT(n) \
+do { \
+     if (preempt_count != (n)) \
+       { \
+         cout << __FILE__ << ":" << __LINE__ \
+              << ", failed ASSERT_PREEMPT_COUNT(" << (n) << ")\n"; \
+       } \
+   } while (0)
+
+#else
+
+#define ASSERT_PREEMPT_DISABLED()
+#define ASSERT_PREEMPT_COUNT(n)
+
 #endif
 
+// Voluntary context switch from a section where preemption is
+// disabled.  Every context switch happens with "preempt_count" equal
+// to 1, so the count is the same when the thread resumes.
+
+#define context_switch(receiver,data) \
+do { \
+     ASSERT_PREEMPT_COUNT (1); \
+     disable_interrupts (); \
+     save_minimal_context (receiver, data); \
+     enable_interrupts (); \
+   } while (0)
+
 //-----------------------------------------------------------------------------
 
 // Available thread priorities.
@@ -117,9 +228,17 @@ typedef int priority;
 #define normal_priority 100
 #define high_priority   200
 
+// The threads waiting on a mutex or condition variable are served in
+// order of priority, with the priorities grouped in a few levels.
+
+#define NB_WAIT_LEVELS 4
+
 //-----------------------------------------------------------------------------
 
-// Select implementations.
+// Select implementations.  The singly-linked lists save one link per
+// node, but make the queue operations linear in the number of queued
+// threads (see "queue.h"), which for the wait queues includes the run
+// queue.  They only pay off with a few threads.
 
 #define USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
 #define USE_DOUBLY_LINKED_LIST_FOR_MUTEX_QUEUE
@@ -142,18 +261,18 @@ class wait_mutex_node
     // synchronization object or the run queue it is the queue of
     // waiting threads.
 
+    wait_mutex_node* _next_in_wait_queue;
 #ifdef USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
-    wait_mutex_node* volatile _next_in_wait_queue;
-    wait_mutex_node* volatile _prev_in_wait_queue;
+    wait_mutex_node* _prev_in_wait_queue;
 #endif
 
     // Mutex queue part for maintaining the set of mutexes owned by a
     // thread.  If this object is a mutex it is a queue element; if
     // this object is a thread it is the queue of owned mutexes.
 
+    wait_mutex_node* _next_in_mutex_queue;
 #ifdef USE_DOUBLY_LINKED_LIST_FOR_MUTEX_QUEUE
-    wait_mutex_node* volatile _next_in_mutex_queue;
-    wait_mutex_node* volatile _prev_in_mutex_queue;
+    wait_mutex_node* _prev_in_mutex_queue;
 #endif
   };
 
@@ -171,6 +290,19 @@ class wait_queue : public wait_mutex_node
 
 //-----------------------------------------------------------------------------
 
+// "prio_wait_queue" class declaration.
+
+class prio_wait_queue : public wait_queue
+  {
+  public:
+
+#ifdef USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
+    wait_mutex_node _level_end[NB_WAIT_LEVELS]; // end of each level
+#endif
+  };
+
+//-----------------------------------------------------------------------------
+
 // "mutex_queue" class declaration.
 
 class mutex_queue : public wait_mutex_node
@@ -196,9 +328,9 @@ class wait_mutex_sleep_node : public mutex_queue
     // queue; if this object is the run queue it is the queue of
     // threads waiting for a timeout.
 
+    wait_mutex_sleep_node* _next_in_sleep_queue;
 #ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-    wait_mutex_sleep_node* volatile _next_in_sleep_queue;
-    wait_mutex_sleep_node* volatile _prev_in_sleep_queue;
+    wait_mutex_sleep_node* _prev_in_sleep_queue;
 #endif
   };
 
@@ -218,12 +350,15 @@ class sleep_queue : public wait_mutex_sleep_node
 
 // "mutex" class declaration.
 
-class mutex : public wait_queue
+class mutex : public prio_wait_queue
   {
   public:
 
     mutex (); // constructs an unlocked mutex
 
+    void* operator new (size_t size); // allocated from a pool
+    void operator delete (void* obj);
+
     void lock (); // waits until mutex is unlocked, and then lock the mutex
     bool lock_or_timeout (time timeout); // returns FALSE if timeout reached
     void unlock (); // unlocks a locked mutex
@@ -244,20 +379,23 @@ class mutex : public wait_queue
 
 // "condvar" class declaration.
 
-class condvar : public wait_queue
+class condvar : public prio_wait_queue
   {
   public:
 
     condvar (); // constructs a condition variable with no waiting threads
 
+    void* operator new (size_t size); // allocated from a pool
+    void operator delete (void* obj);
+
     void wait (mutex* m); // suspends current thread on the condition variable
     bool wait_or_timeout (mutex* m, time timeout); // returns FALSE on timeout
 
     void signal (); // resumes one of the waiting threads
     void broadcast (); // resumes all of the waiting threads
 
-    void mutexless_wait (); // like "wait" but uses interrupt flag as mutex
-    void mutexless_signal (); // like "signal" but assumes disabled interrupts
+    void mutexless_wait (); // like "wait" but uses preempt_disable as mutex
+    void mutexless_signal (); // like "signal" but assumes disabled preemption
 
     // The inherited "wait queue" part of wait_queue is used to
     // maintain the set of threads waiting on this condvar.
@@ -271,12 +409,19 @@ class condvar : public wait_queue
 
 typedef void (*void_fn) ();
 
+// The IRQs and the deferred work run on the interrupt stack (see
+// "intr.h"), so the thread stacks only need room for the frames of
+// the thread itself and for one "save_context" frame.
+
+#define DEFAULT_STACK_SIZE 16384 // size of thread stacks in bytes
+
 class thread : public wait_mutex_sleep_node
   {
   public:
 
-    // constructs a thread that will call "run"
-    thread ();
+    // constructs a thread that will call "run" on a stack of the
+    // given size (in bytes)
+    thread (uint32 stack_size = DEFAULT_STACK_SIZE);
 
     virtual ~thread (); // thread destructor
 
@@ -287,6 +432,33 @@ class thread : public wait_mutex_sleep_node
     static void yield (); // immediately ends the thread's quantum
     static thread* self (); // returns a pointer to currently running thread
 
+    // Suspend the current thread until time "t" (or for "duration").
+    // The thread may be woken up as late as "slack" after that time,
+    // which allows the scheduler to serve several nearby wakeups with
+    // a single timer interrupt.
+
+    static void sleep_until (time t);
+    static void sleep_until (time t, time slack);
+    static void sleep_for (time duration);
+    static void sleep_for (time duration, time slack);
+
+    // The stack is filled with a canary pattern when the thread is
+    // created, so the deepest point reached by the stack can be found
+    // by looking for the first word that was overwritten.
+
+    uint32 stack_size (); // size of the stack in bytes
+    uint32 stack_high_water (); // maximum number of stack bytes used
+    bool stack_overflowed (); // TRUE if the bottom canary was overwritten
+
+    static void report_stacks (); // shows the stack usage of all threads
+
+    // The priority decides the order in which the threads waiting on
+    // a mutex or condition variable are resumed.  A new priority only
+    // affects the thread's next wait.
+
+    priority get_priority (); // returns the thread's priority
+    void set_priority (priority p); // sets the thread's priority
+
     // The inherited "wait queue" part of wait_mutex_sleep_node
     // is used to maintain this thread in the wait_queue of the mutex
     // or condvar on which it is waiting.
@@ -304,6 +476,7 @@ class thread : public wait_mutex_sleep_node
 #endif
 
     time _timeout; // when to end sleeping
+    time _slack;   // how late after "_timeout" the wakeup may be
     bool _did_not_timeout; // to tell if synchronization operation timed out
 
   protected:
@@ -312,11 +485,17 @@ class thread : public wait_mutex_sleep_node
 
     uint32* _stack; // the thread's stack
     uint32* _sp;    // the thread's stack pointer
+    uint32 _stack_pages; // number of pages of the stack (including guard)
+
+    thread* _next_thread; // list of all threads (for "report_stacks")
+    thread* _prev_thread;
+
+    static thread* all_threads;
 
     time _quantum;        // duration of the quantum for this thread
     time _end_of_quantum; // moment in time when current quantum ends
 
-    int _prio; // the thread's priority
+    priority _prio; // the thread's priority
 
     mutex _m; // mutex to access termination flag
     condvar _joiners; // threads waiting for this thread to terminate
@@ -325,18 +504,43 @@ class thread : public wait_mutex_sleep_node
     friend class mutex;
     friend class condvar;
     friend class scheduler;
+    friend class wait_level;
   };
 
 //-----------------------------------------------------------------------------
 
 // "scheduler" class declaration.
 
+#ifdef USE_PIT_FOR_TIMER
+void PIT_timer_irq (void* arg); // IRQ0 handler
+#endif
+
 class scheduler
   {
   public:
 
     static void setup (void_fn continuation); // initializes the scheduler
 
+    // number of timer interrupts avoided by serving several sleeping
+    // threads' wakeups with a single interrupt
+    static uint32 timer_interrupts_saved ();
+
+    // switches to the next thread if the quantum of the current thread
+    // has ended (called at the end of an IRQ with interrupts disabled)
+    static void preempt_if_needed ();
+
+    static bool resched_needed (); // TRUE when "preempt" must be called
+
+    // switches to the next thread, the current thread's context having
+    // been saved at "sp" in the format of "save_context" (called by the
+    // IRQ trampolines with interrupts disabled)
+    static void preempt (uint32* sp);
+
+#ifdef SHOW_CONTEXT_SWITCH_BENCHMARK
+    // measures the cost of the voluntary context switches
+    static void benchmark_context_switch ();
+#endif
+
   protected:
 
     static void reschedule_thread (thread* t); // makes thread "t" runnable
@@ -368,114 +572,120 @@ class scheduler
 
     static void setup_timer ();     // initializes the interval timer
     static void set_timer (time t, time now); // sets the timer to time "t"
+    static void arm_timer (time now); // sets the timer for the next event
     static void timer_elapsed ();   // called when the interval timer expires
+    static void timer_bottom_half (void* arg); // deferred part of the above
+
+#ifdef SHOW_CONTEXT_SWITCH_BENCHMARK
+    // like "thread::yield" but saves all the registers with "save_context"
+    static void yield_with_full_save ();
+#endif
 
     static wait_queue* readyq;            // the ready queue
     static sleep_queue* sleepq;           // the sleep queue
     static thread* the_primordial_thread; // the primordial thread
     static thread* current_thread;        // the current thread
 
+    static time timer_expiry;          // when the timer was set to expire
+    static uint32 coalesced_wakeups;   // wakeups served by another's timer
+    static deferred_work timer_work;   // runs "timer_bottom_half"
+    static bool need_resched;          // TRUE when the quantum has ended
+
     friend class mutex;
     friend class condvar;
     friend class thread;
 #ifdef USE_PIT_FOR_TIMER
-    friend void irq0 ();
+    friend void PIT_timer_irq (void* arg);
 #endif
 #ifdef USE_APIC_FOR_TIMER
-    friend void APIC_timer_irq ();
+    friend bool APIC_timer_irq ();
 #endif
   };
 
 //-----------------------------------------------------------------------------
 
-// "wait_mutex_node" class implementation.
+// Queue operations.  The queues use doubly-linked lists unless the
+// corresponding USE_DOUBLY_LINKED_LIST_FOR_... is undefined.
 
-#define NODETYPE wait_mutex_node
-#define QUEUETYPE wait_queue
-#define ELEMTYPE thread
-#define NAMESPACE_PREFIX(name) wait_queue_##name
-#define BEFORE(elem1,elem2) FALSE
+class timeout_order
+  {
+  public:
+
+    static bool before (thread* t1, thread* t2)
+      {
+        return less_time (t1->_timeout, t2->_timeout);
+      }
+  };
 
 #ifdef USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
-#define USE_DOUBLY_LINKED_LIST
-#define NEXT(node) (node)->_next_in_wait_queue
-#define NEXT_SET(node,next_node) NEXT (node) = (next_node)
-#define PREV(node) (node)->_prev_in_wait_queue
-#define PREV_SET(node,prev_node) PREV (node) = (prev_node)
-#include "queue.h"
-#undef USE_DOUBLY_LINKED_LIST
-#undef NEXT
-#undef NEXT_SET
-#undef PREV
-#undef PREV_SET
+typedef doubly_linked_queue<wait_mutex_node, wait_queue, thread,
+                            &wait_mutex_node::_next_in_wait_queue,
+                            &wait_mutex_node::_prev_in_wait_queue,
+                            fifo_order<thread> > wait_queue_ops;
+#else
+typedef singly_linked_queue<wait_mutex_node, wait_queue, thread,
+                            &wait_mutex_node::_next_in_wait_queue,
+                            fifo_order<thread> > wait_queue_ops;
 #endif
 
-#undef NODETYPE
-#undef QUEUETYPE
-#undef ELEMTYPE
-#undef NAMESPACE_PREFIX
-#undef BEFORE
+// Wait queue ordered by the threads' priority level, in decreasing order.
 
-//-----------------------------------------------------------------------------
+class wait_level
+  {
+  public:
 
-// "wait_mutex_node" class implementation.
+    static int level (thread* t)
+      {
+        int l = t->_prio * (NB_WAIT_LEVELS-1) / high_priority;
 
-#define NODETYPE wait_mutex_node
-#define QUEUETYPE mutex_queue
-#define ELEMTYPE mutex
-#define NAMESPACE_PREFIX(name) mutex_queue_##name
-#define BEFORE(elem1,elem2) FALSE
+        if (l < 0)
+          return 0;
 
-#ifdef USE_DOUBLY_LINKED_LIST_FOR_MUTEX_QUEUE
-#define USE_DOUBLY_LINKED_LIST
-#define NEXT(node) (node)->_next_in_mutex_queue
-#define NEXT_SET(node,next_node) NEXT (node) = (next_node)
-#define PREV(node) (node)->_prev_in_mutex_queue
-#define PREV_SET(node,prev_node) PREV (node) = (prev_node)
-#include "queue.h"
-#undef USE_DOUBLY_LINKED_LIST
-#undef NEXT
-#undef NEXT_SET
-#undef PREV
-#undef PREV_SET
-#endif
+        if (l > NB_WAIT_LEVELS-1)
+          return NB_WAIT_LEVELS-1;
 
-#undef NODETYPE
-#undef QUEUETYPE
-#undef ELEMTYPE
-#undef NAMESPACE_PREFIX
-#undef BEFORE
+        return l;
+      }
 
-//-----------------------------------------------------------------------------
+    static bool before (thread* t1, thread* t2)
+      {
+        return level (t1) > level (t2);
+      }
+  };
 
-// "wait_mutex_sleep_node" class implementation.
+#ifdef USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
+typedef leveled_queue<wait_mutex_node, prio_wait_queue, thread,
+                      &wait_mutex_node::_next_in_wait_queue,
+                      &wait_mutex_node::_prev_in_wait_queue,
+                      wait_level, NB_WAIT_LEVELS> prio_wait_queue_ops;
+#else
+typedef singly_linked_queue<wait_mutex_node, prio_wait_queue, thread,
+                            &wait_mutex_node::_next_in_wait_queue,
+                            wait_level> prio_wait_queue_ops;
+#endif
 
-#define NODETYPE wait_mutex_sleep_node
-#define QUEUETYPE sleep_queue
-#define ELEMTYPE thread
-#define NAMESPACE_PREFIX(name) sleep_queue_##name
-#define BEFORE(elem1,elem2) less_time ((elem1)->_timeout, (elem2)->_timeout)
+#ifdef USE_DOUBLY_LINKED_LIST_FOR_MUTEX_QUEUE
+typedef doubly_linked_queue<wait_mutex_node, mutex_queue, mutex,
+                            &wait_mutex_node::_next_in_mutex_queue,
+                            &wait_mutex_node::_prev_in_mutex_queue,
+                            fifo_order<mutex> > mutex_queue_ops;
+#else
+typedef singly_linked_queue<wait_mutex_node, mutex_queue, mutex,
+                            &wait_mutex_node::_next_in_mutex_queue,
+                            fifo_order<mutex> > mutex_queue_ops;
+#endif
 
 #ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-#define USE_DOUBLY_LINKED_LIST
-#define NEXT(node) (node)->_next_in_sleep_queue
-#define NEXT_SET(node,next_node) NEXT (node) = (next_node)
-#define PREV(node) (node)->_prev_in_sleep_queue
-#define PREV_SET(node,prev_node) PREV (node) = (prev_node)
-#include "queue.h"
-#undef USE_DOUBLY_LINKED_LIST
-#undef NEXT
-#undef NEXT_SET
-#undef PREV
-#undef PREV_SET
+typedef doubly_linked_queue<wait_mutex_sleep_node, sleep_queue, thread,
+                            &wait_mutex_sleep_node::_next_in_sleep_queue,
+                            &wait_mutex_sleep_node::_prev_in_sleep_queue,
+                            timeout_order> sleep_queue_ops;
+#else
+typedef singly_linked_queue<wait_mutex_sleep_node, sleep_queue, thread,
+                            &wait_mutex_sleep_node::_next_in_sleep_queue,
+                            timeout_order> sleep_queue_ops;
 #endif
 
-#undef NODETYPE
-#undef QUEUETYPE
-#undef ELEMTYPE
-#undef NAMESPACE_PREFIX
-#undef BEFORE
-
 //-----------------------------------------------------------------------------
 
 #endif
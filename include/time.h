@@ -170,6 +170,19 @@ extern rational _cpu_bus_multiplier;
 
 //-----------------------------------------------------------------------------
 
+// Nanosecond clocks.  "monotonic_ns" returns the number of nanoseconds
+// elapsed since the time manager was initialized, and "realtime"
+// returns the number of nanoseconds since 1 Jan 1970 00:00:00 as read
+// from the RTC at boot (or as last set with "set_realtime").  Reading
+// the clocks never disables interrupts, so they can be used for
+// timestamps anywhere, including in interrupt handlers.
+
+uint64 monotonic_ns ();
+uint64 realtime ();
+void set_realtime (uint64 ns);
+
+//-----------------------------------------------------------------------------
+
 #endif
 
 // Local Variables: //
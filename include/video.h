@@ -172,6 +172,9 @@ class video : public raw_bitmap
 
     void move_mouse (int dx, int dy);
 
+    void enable_write_combining ();
+    void benchmark_fill_rect ();
+
     virtual void hide_mouse ();
     virtual void show_mouse ();
 
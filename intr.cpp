@@ -9,10 +9,96 @@
 //-----------------------------------------------------------------------------
 
 #include "intr.h"
+#include "thread.h"
 #include "asm.h"
 #include "pic.h"
 #include "apic.h"
 #include "term.h"
+#include "page.h"
+#include "rtlib.h"
+
+//-----------------------------------------------------------------------------
+
+// Double fault handling.
+//
+// When a thread overflows its stack into the guard page, the CPU can't
+// push the page fault's exception frame and signals a double fault.
+// The double fault is handled by a separate task, with its own stack,
+// through a task gate, so that the fault can be reported cleanly
+// instead of causing a triple fault (processor reset).  The CPU saves
+// the state of the faulting thread in "main_tss".
+
+struct tss
+  {
+    uint32 link;
+    uint32 esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32 cr3, eip, eflags;
+    uint32 eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32 es, cs, ss, ds, fs, gs, ldt;
+    uint16 trap, iomap_base;
+  };
+
+// These must match the definitions in "kernel.s".
+
+#define INTR_DESCR_TABLE   0x800
+#define GLOBAL_DESCR_TABLE 0x10000
+#define CODE_SEG_SEL       0x10
+#define DATA_SEG_SEL       0x18
+
+#define MAIN_TSS_SEL         (4<<3) // GDT entries after the data segment
+#define DOUBLE_FAULT_TSS_SEL (5<<3)
+#define DOUBLE_FAULT_INTR    8
+
+static tss main_tss;
+static tss double_fault_tss;
+static uint32 double_fault_stack[1024];
+
+static void double_fault_task ()
+{
+  cout << "\033[41m double fault eip=" << CAST(void*,main_tss.eip)
+       << " esp=" << CAST(void*,main_tss.esp);
+
+  if (!page_present (CAST(void*,main_tss.esp - 4)))
+    cout << " (stack overflow)";
+
+  cout << " \033[0m\n";
+
+  fatal_error ("double fault");
+}
+
+static void set_tss_descr (uint32 sel, tss* t)
+{
+  uint32* descr = CAST(uint32*,GLOBAL_DESCR_TABLE + sel);
+  uint32 base = CAST(uint32,t);
+
+  descr[0] = (base << 16) | (sizeof (tss) - 1);
+  descr[1] = (base & 0xff000000) | 0x8900 | ((base >> 16) & 0xff); // TSS
+}
+
+static void setup_double_fault_task ()
+{
+  tss* t = &double_fault_tss;
+
+  t->cr3 = PAGE_DIR;
+  t->eip = CAST(uint32,&double_fault_task);
+  t->eflags = 0x2; // interrupts disabled
+  t->esp = CAST(uint32,&double_fault_stack[1024]);
+  t->cs = CODE_SEG_SEL;
+  t->ss = t->ds = t->es = DATA_SEG_SEL;
+  t->iomap_base = sizeof (tss);
+
+  main_tss.iomap_base = sizeof (tss);
+
+  set_tss_descr (MAIN_TSS_SEL, &main_tss);
+  set_tss_descr (DOUBLE_FAULT_TSS_SEL, t);
+
+  uint32* gate = fixed_address(uint32*,INTR_DESCR_TABLE + 8*DOUBLE_FAULT_INTR);
+
+  gate[0] = DOUBLE_FAULT_TSS_SEL << 16;
+  gate[1] = 0x8500; // present task gate
+
+  ltr (MAIN_TSS_SEL);
+}
 
 //-----------------------------------------------------------------------------
 
@@ -22,21 +108,55 @@
 
 void setup_intr ()
 {
-#ifdef USE_APIC_FOR_TIMER
+  setup_double_fault_task ();
+
+#ifdef USE_LOCAL_APIC
 
   // Make sure that the local APIC is mapped to the default memory
   // location and that it is enabled.
 
-  uint32 dummy, features;
+  uint32 dummy, ext_features, features;
 
-  cpuid (1, dummy, dummy, dummy, features);
+  cpuid (1, dummy, dummy, ext_features, features);
 
   if (features & HAS_MSR)
     {
       uint64 x = rdmsr (MSR_APIC);
-      x &= MSR_APIC_BSP;
-      x |= MSR_APIC_BASE | MSR_APIC_E;
-      wrmsr (MSR_APIC, x);
+
+      // The firmware or the bootloader may have left the APIC in
+      // x2APIC mode, which can only be left by disabling the APIC
+      // (clearing EXTD alone raises a general protection fault).
+
+      if (x & MSR_APIC_EXTD)
+        {
+#ifdef USE_X2APIC
+          apic_x2 = TRUE; // keep the x2APIC mode
+#else
+          wrmsr (MSR_APIC, x & ~(MSR_APIC_E | MSR_APIC_EXTD));
+#endif
+        }
+
+#ifdef USE_X2APIC
+      if (!apic_x2)
+#endif
+        {
+          x &= MSR_APIC_BSP;
+          x |= MSR_APIC_BASE | MSR_APIC_E;
+          wrmsr (MSR_APIC, x);
+
+#ifdef USE_X2APIC
+
+          // The x2APIC mode can only be entered from the enabled xAPIC
+          // mode, and the xAPIC mode is kept if the CPU lacks x2APIC.
+
+          if (ext_features & HAS_X2APIC)
+            {
+              wrmsr (MSR_APIC, x | MSR_APIC_EXTD);
+              apic_x2 = TRUE;
+            }
+
+#endif
+        }
     }
 
   uint32 x;
@@ -52,13 +172,18 @@ void setup_intr ()
   x &= ~APIC_TPR_PRIO_MASK; // Accept all interrupts
   APIC_TPR = x;
 
-  x = APIC_LDR;
-  x &= ~APIC_LDR_LOGID_MASK; // Logical APIC ID = 0
-  APIC_LDR = x;
+#ifdef USE_X2APIC
+  if (!apic_x2) // LDR is read-only and DFR does not exist in x2APIC mode
+#endif
+    {
+      x = APIC_LDR;
+      x &= ~APIC_LDR_LOGID_MASK; // Logical APIC ID = 0
+      APIC_LDR = x;
 
-  x = APIC_DFR;
-  x |= APIC_DFR_CONFIG (0x0f); // Flat model
-  APIC_DFR = x;
+      x = APIC_DFR;
+      x |= APIC_DFR_CONFIG (0x0f); // Flat model
+      APIC_DFR = x;
+    }
 
 #ifdef USE_APIC_FOR_TIMER
 
@@ -111,7 +236,12 @@ void setup_intr ()
   outb (PIC_MASTER_ICW3(PIC_MASTER_ICW3_SLAVE(2)), PIC_PORT_MASTER_ICW3);
   outb (PIC_SLAVE_ICW3(2), PIC_PORT_SLAVE_ICW3);
 
+#ifdef USE_PIC_AUTO_EOI
+  outb (PIC_ICW4(PIC_ICW4_8086|PIC_ICW4_MASTER|PIC_ICW4_AEOI),
+        PIC_PORT_MASTER_ICW4);
+#else
   outb (PIC_ICW4(PIC_ICW4_8086|PIC_ICW4_MASTER), PIC_PORT_MASTER_ICW4);
+#endif
   outb (PIC_ICW4(PIC_ICW4_8086), PIC_PORT_SLAVE_ICW4);
 
   // Disable interrupts on IRQ0, IRQ1, IRQ3 .. IRQ15
@@ -124,203 +254,484 @@ void setup_intr ()
   // interrupt handlers (in particular the timer interrupt handler
   // which drives the thread scheduler).
 
-  outb (PIC_OCW1_MASK(PIC_MASTER_IRQ0) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ1) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ3) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ4) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ5) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ6) |
-        PIC_OCW1_MASK(PIC_MASTER_IRQ7),
-        PIC_PORT_MASTER_OCW1);
-
-  outb (PIC_OCW1_MASK(PIC_SLAVE_IRQ8) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ9) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ10) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ11) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ12) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ13) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ14) |
-        PIC_OCW1_MASK(PIC_SLAVE_IRQ15),
-        PIC_PORT_SLAVE_OCW1);
+  pic_master_mask = PIC_OCW1_MASK(PIC_MASTER_IRQ0) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ1) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ3) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ4) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ5) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ6) |
+                    PIC_OCW1_MASK(PIC_MASTER_IRQ7);
+
+  pic_slave_mask = PIC_OCW1_MASK(PIC_SLAVE_IRQ8) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ9) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ10) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ11) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ12) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ13) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ14) |
+                   PIC_OCW1_MASK(PIC_SLAVE_IRQ15);
+
+  outb (pic_master_mask, PIC_PORT_MASTER_OCW1);
+  outb (pic_slave_mask, PIC_PORT_SLAVE_OCW1);
+
+#ifdef USE_IOAPIC_FOR_IRQS
+  setup_ioapic (); // falls back to the PICs if there is no I/O APIC
+#endif
 }
 
-#ifndef USE_PIT_FOR_TIMER
+volatile uint8 pic_master_mask;
+volatile uint8 pic_slave_mask;
 
-void irq0 ()
-{
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq0 \033[0m";
+#ifdef USE_X2APIC
+bool apic_x2;
 #endif
 
-  ACKNOWLEDGE_IRQ(0);
-}
+//-----------------------------------------------------------------------------
 
-#endif
+// IRQ dispatch.
 
-#ifndef USE_IRQ1_FOR_KEYBOARD
+struct irq_action
+  {
+    irq_handler fn;
+    void* arg;
+    irq_action* next;
+  };
 
-void irq1 ()
+static irq_action irq_actions[NB_IRQ_HANDLERS];
+static irq_action* irq_handlers[NB_IRQS];
+static uint32 irq_counts[NB_IRQS];
+static uint32 irq_nesting; // number of IRQ handlers on the stack
+
+bool register_irq_handler (int irq, irq_handler fn, void* arg)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq1 \033[0m";
-#endif
+  uint32 flags = save_flags_and_disable_interrupts ();
 
-  ACKNOWLEDGE_IRQ(1);
-}
+  for (int i = 0; i < NB_IRQ_HANDLERS; i++)
+    {
+      irq_action* a = &irq_actions[i];
 
-#endif
+      if (a->fn == NULL)
+        {
+          irq_action** last = &irq_handlers[irq];
 
-void irq2 ()
-{
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq2 \033[0m";
-#endif
+          while (*last != NULL)
+            last = &(*last)->next;
 
-  ACKNOWLEDGE_IRQ(2);
-}
+          a->fn = fn;
+          a->arg = arg;
+          a->next = NULL;
+          *last = a;
 
-void irq3 ()
-{
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq3 \033[0m";
-#endif
+          restore_flags (flags);
 
-  ACKNOWLEDGE_IRQ(3);
+          return TRUE;
+        }
+    }
+
+  restore_flags (flags);
+
+  return FALSE;
 }
 
-void irq4 ()
+void unregister_irq_handler (int irq, irq_handler fn, void* arg)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq4 \033[0m";
-#endif
+  uint32 flags = save_flags_and_disable_interrupts ();
 
-  ACKNOWLEDGE_IRQ(4);
+  for (irq_action** p = &irq_handlers[irq]; *p != NULL; p = &(*p)->next)
+    {
+      irq_action* a = *p;
+
+      if (a->fn == fn && a->arg == arg)
+        {
+          *p = a->next;
+          a->fn = NULL;
+          break;
+        }
+    }
+
+  restore_flags (flags);
 }
 
-void irq5 ()
+uint32 irq_count (int irq)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq5 \033[0m";
-#endif
-
-  ACKNOWLEDGE_IRQ(5);
+  return irq_counts[irq];
 }
 
-void irq6 ()
+//-----------------------------------------------------------------------------
+
+// IRQ priorities.
+//
+// With the I/O APIC, the priority of an IRQ is given by the priority
+// class (upper 4 bits) of its vector, so each IRQ priority has its own
+// range of vectors.  The IRQ_PRIO_HIGH range is the one used with the
+// PICs (and by "kernel.s"), so the other ranges are created by copying
+// the interrupt descriptors of that range.
+
+#define H IRQ_PRIO_HIGH
+
+static uint8 irq_prio[NB_IRQS] = { H, H, H, H, H, H, H, H,
+                                   H, H, H, H, H, H, H, H };
+
+#undef H
+static uint16 irq_prio_mask[NB_IRQ_PRIOS]; // IRQs of same or lower priority
+
+volatile uint16 irq_priority_mask;
+
+#ifdef USE_IOAPIC_FOR_IRQS
+static const uint32 irq_vector_base[NB_IRQ_PRIOS] = { 0x70, 0x80, IRQ0_VECTOR };
+#endif
+
+void set_irq_priority (int irq, int prio)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq6 \033[0m";
+  if (irq < 0 || irq >= NB_IRQS || prio < 0 || prio >= NB_IRQ_PRIOS)
+    fatal_error ("set_irq_priority: invalid IRQ or priority");
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  irq_prio[irq] = prio;
+
+  for (int p = 0; p < NB_IRQ_PRIOS; p++)
+    {
+      irq_prio_mask[p] = 0;
+      for (int i = 0; i < NB_IRQS; i++)
+        if (irq_prio[i] <= p)
+          irq_prio_mask[p] |= 1 << i;
+    }
+
+#ifdef USE_IOAPIC_FOR_IRQS
+
+  if (irqs_use_ioapic)
+    {
+      uint32 vector = irq_vector_base[prio] + irq;
+      uint32* idt = fixed_address(uint32*,INTR_DESCR_TABLE);
+
+      idt[2*vector]   = idt[2*(IRQ0_VECTOR+irq)];
+      idt[2*vector+1] = idt[2*(IRQ0_VECTOR+irq)+1];
+
+      ioapic_set_vector (irq, vector);
+    }
+
 #endif
 
-  ACKNOWLEDGE_IRQ(6);
+  restore_flags (flags);
 }
 
-void irq7 ()
+static void set_pic_masks (uint16 prio_mask)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq7 \033[0m";
-#endif
+  uint16 old = irq_priority_mask;
+
+  irq_priority_mask = prio_mask;
+
+  if (CAST(uint8,old ^ prio_mask) != 0)
+    outb (pic_master_mask | CAST(uint8,prio_mask), PIC_PORT_MASTER_OCW1);
 
-  ACKNOWLEDGE_IRQ(7);
+  if (CAST(uint8,(old ^ prio_mask) >> 8) != 0)
+    outb (pic_slave_mask | CAST(uint8,prio_mask >> 8), PIC_PORT_SLAVE_OCW1);
 }
 
-#ifndef USE_IRQ8_FOR_TIME
+static void run_irq_handlers (int irq)
+{
+  for (irq_action* a = irq_handlers[irq]; a != NULL; a = a->next)
+    a->fn (a->arg);
+}
 
-void irq8 ()
+bool irq_dispatch (int irq)
 {
+#ifdef PROFILE_INTERRUPTS_DISABLED
+  intr_off_begin ("irq", irq);
+#endif
+
+  irq_counts[irq]++;
+  irq_nesting++;
+
 #ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq8 \033[0m";
+  cout << "\033[41m irq" << irq << " \033[0m";
 #endif
 
-  ACKNOWLEDGE_IRQ(8);
-}
+  ACKNOWLEDGE_IRQ(irq);
 
+  int prio = irq_prio[irq];
+
+  if (prio == IRQ_PRIO_HIGH)
+    run_irq_handlers (irq);
+  else
+    {
+#ifdef USE_IOAPIC_FOR_IRQS
+      if (irqs_use_ioapic)
+        {
+          uint32 tpr = APIC_TPR;
+
+          APIC_TPR = (tpr & ~APIC_TPR_PRIO_MASK)
+                     | (irq_vector_base[prio] & 0xf0);
+          enable_interrupts ();
+          run_irq_handlers (irq);
+          disable_interrupts ();
+          APIC_TPR = tpr;
+        }
+      else
 #endif
+        {
+          uint16 prio_mask = irq_priority_mask;
+
+          set_pic_masks (prio_mask | irq_prio_mask[prio]);
+          enable_interrupts ();
+          run_irq_handlers (irq);
+          disable_interrupts ();
+          set_pic_masks (prio_mask);
+        }
+    }
 
-void irq9 ()
-{
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq9 \033[0m";
+  irq_nesting--;
+
+  bool preempt = run_deferred_work ();
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+  // When the thread is preempted the section also covers the context
+  // switch, so it is ended by the thread which is resumed.
+  if (!preempt)
+    intr_off_end ();
 #endif
 
-  ACKNOWLEDGE_IRQ(9);
+  return preempt;
 }
 
-void irq10 ()
+void irq_preempt (uint32 cs, uint32 eflags, uint32* sp, void* dummy)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq10 \033[0m";
-#endif
+  // Called by "irq_return" in "kernel.s" on the thread stack with
+  // interrupts disabled.  The interrupted context was saved at "sp" in
+  // the format of "save_context".
 
-  ACKNOWLEDGE_IRQ(10);
+  scheduler::preempt (sp);
+
+  // ** NEVER REACHED ** (this function never returns)
 }
 
-void irq11 ()
+void irq_resume_thread ()
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq11 \033[0m";
+  // Called by "irq_return" in "kernel.s" with interrupts disabled when
+  // a thread which was preempted by an IRQ is resumed, just before it
+  // returns to the interrupted code.  This is where the preemption
+  // count of the resumed thread returns to 0, so the work queued while
+  // the previous thread had preemption disabled is run here as in
+  // "preempt_enable" instead of waiting for the next IRQ.
+
+  preempt_count = 0; // the thread was resumed with a count of 1
+
+  if (deferred_head != NULL)
+    irq_exit ();
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+  intr_off_end (); // ends the section of the thread which switched here
 #endif
+}
+
+//-----------------------------------------------------------------------------
+
+// Interrupt stack.
+
+static uint32 irq_stack[IRQ_STACK_SIZE/sizeof(uint32)];
+
+uint32* irq_stack_top = irq_stack + IRQ_STACK_SIZE/sizeof(uint32);
+uint32 irq_stack_depth;
 
-  ACKNOWLEDGE_IRQ(11);
+//-----------------------------------------------------------------------------
+
+// Deferred work.
+
+deferred_work* volatile deferred_head;
+static deferred_work* deferred_tail;
+
+void defer_work (deferred_work* w)
+{
+  if (!w->queued)
+    {
+      w->queued = TRUE;
+      w->next = NULL;
+      if (deferred_head == NULL)
+        deferred_head = w;
+      else
+        deferred_tail->next = w;
+      deferred_tail = w;
+    }
 }
 
-#ifndef USE_IRQ12_FOR_MOUSE
+void irq_exit ()
+{
+  // Called on a thread stack, so the work is run on the interrupt
+  // stack and the preemption is done after coming back.
+
+  if (run_deferred_work_on_irq_stack ())
+    scheduler::preempt_if_needed ();
+}
 
-void irq12 ()
+bool run_deferred_work ()
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq12 \033[0m";
-#endif
+  // Interrupts are disabled here.
+
+  if (irq_nesting != 0 || preempt_count != 0)
+    return FALSE; // the outer IRQ or "preempt_enable" will run the work
+
+  preempt_count = 1;
+
+  while (deferred_head != NULL)
+    {
+      deferred_work* w = deferred_head;
+
+      deferred_head = w->next;
+      w->queued = FALSE;
 
-  ACKNOWLEDGE_IRQ(12);
+      enable_interrupts ();
+      w->fn (w->arg);
+      disable_interrupts ();
+    }
+
+  preempt_count = 0;
+
+  // Preemption is done after the deferred work so that the work of
+  // other IRQs is not held up while the interrupted thread waits for
+  // the CPU.
+
+  return scheduler::resched_needed ();
 }
 
-#endif
+volatile bool preempt_resume_pending;
 
-void irq13 ()
+void preempt_resume ()
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq13 \033[0m";
-#endif
+  // The work can only be run if the caller had interrupts enabled,
+  // otherwise it is run when interrupts are enabled again (see
+  // "run_pending_preempt_resume").  If "irq_exit" declines to run it
+  // the work is left to the enclosing IRQ or "preempt_enable".
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (flags & (1<<9))
+    {
+      preempt_resume_pending = FALSE;
+      irq_exit ();
+    }
+  else
+    preempt_resume_pending = TRUE;
 
-  ACKNOWLEDGE_IRQ(13);
+  restore_flags (flags);
 }
 
-#ifndef USE_IRQ14_FOR_IDE0
+//-----------------------------------------------------------------------------
 
-void irq14 ()
+// Profiling of the sections with interrupts disabled.
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+
+struct intr_off_site
+  {
+    const char* file;
+    int line;
+    uint32 count;
+    uint64 total;
+    uint64 max;
+    uint32 histogram[32];
+  };
+
+#define NB_INTR_OFF_SITES 128 // must be a power of 2
+
+static intr_off_site intr_off_sites[NB_INTR_OFF_SITES+1]; // +1 for overflow
+static intr_off_site* intr_off_current;
+static uint64 intr_off_start;
+
+void intr_off_begin (const char* file, int line)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq14 \033[0m";
-#endif
+  uint32 h = (CAST(uint32,file) + line * 31) & (NB_INTR_OFF_SITES-1);
+  intr_off_site* s = &intr_off_sites[NB_INTR_OFF_SITES];
 
-  ACKNOWLEDGE_IRQ(14);
+  for (int i = 0; i < NB_INTR_OFF_SITES; i++)
+    {
+      intr_off_site* x = &intr_off_sites[(h + i) & (NB_INTR_OFF_SITES-1)];
+
+      if (x->file == NULL)
+        {
+          x->file = file;
+          x->line = line;
+        }
+
+      if (x->file == file && x->line == line)
+        {
+          s = x;
+          break;
+        }
+    }
+
+  intr_off_current = s;
+  intr_off_start = rdtsc ();
 }
 
-#endif
+void intr_off_end ()
+{
+  intr_off_site* s = intr_off_current;
+
+  if (s == NULL) // interrupts were disabled by the hardware
+    return;
+
+  uint64 cycles = rdtsc () - intr_off_start;
 
-#ifndef USE_IRQ15_FOR_IDE1
+  intr_off_current = NULL;
+
+  s->count++;
+  s->total += cycles;
+  if (cycles > s->max)
+    s->max = cycles;
+
+  if ((cycles >> 32) != 0)
+    s->histogram[31]++; // the last bucket also counts longer durations
+  else
+    s->histogram[(cycles == 0) ? 0 : log2 (CAST(uint32,cycles))]++;
+}
 
-void irq15 ()
+void report_intr_off ()
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq15 \033[0m";
-#endif
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  cout << "interrupts disabled (count, max and mean cycles, histogram):\n";
+
+  for (int i = 0; i <= NB_INTR_OFF_SITES; i++)
+    {
+      intr_off_site* s = &intr_off_sites[i];
+
+      if (s->count == 0)
+        continue;
 
-  ACKNOWLEDGE_IRQ(15);
+      if (s->file == NULL)
+        cout << "  (other places)";
+      else
+        cout << "  " << CAST(native_string,s->file) << ":" << s->line;
+
+      cout << " " << s->count
+           << " " << s->max
+           << " " << s->total / s->count
+           << " ";
+
+      for (int j = 0; j < 32; j++)
+        if (s->histogram[j] != 0)
+          cout << " 2^" << j << ":" << s->histogram[j];
+
+      cout << "\n";
+    }
+
+  restore_flags (flags);
 }
 
 #endif
 
 #ifndef USE_APIC_FOR_TIMER
 
-void APIC_timer_irq ()
+bool APIC_timer_irq ()
 {
 #ifdef SHOW_INTERRUPTS
   cout << "\033[41m APIC timer irq \033[0m";
 #endif
 
   APIC_EOI = 0;
+
+  return FALSE;
 }
 
 #endif
@@ -337,6 +748,16 @@ void APIC_spurious_irq ()
 void unhandled_interrupt (int num)
 {
   cout << "\033[41m unhandled interrupt " << num << " \033[0m";
+
+  if (num == 14) // page fault
+    {
+      uint32 addr = cr2_reg ();
+
+      cout << " page fault at " << CAST(void*,addr);
+
+      if (!page_present (CAST(void*,addr)))
+        cout << " (guard page, stack overflow?)";
+    }
 }
 
 //-----------------------------------------------------------------------------
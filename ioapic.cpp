@@ -0,0 +1,353 @@
+// file: "ioapic.cpp"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+//-----------------------------------------------------------------------------
+
+#include "ioapic.h"
+#include "asm.h"
+#include "apic.h"
+#include "intr.h"
+
+//-----------------------------------------------------------------------------
+
+// Access to the I/O APIC registers.
+
+static volatile uint32* ioapic_base;
+static uint32 ioapic_gsi_base; // first global system interrupt of I/O APIC
+
+static uint32 ioapic_read (uint32 reg)
+{
+  ioapic_base[IOAPIC_IOREGSEL/4] = reg;
+  return ioapic_base[IOAPIC_IOWIN/4];
+}
+
+static void ioapic_write (uint32 reg, uint32 val)
+{
+  ioapic_base[IOAPIC_IOREGSEL/4] = reg;
+  ioapic_base[IOAPIC_IOWIN/4] = val;
+}
+
+//-----------------------------------------------------------------------------
+
+// Routing of the ISA IRQs.  Unless an interrupt source override says
+// otherwise, ISA IRQ "n" is connected to global system interrupt "n"
+// and is edge triggered and active high.  The flags have the format
+// used by the MP specification and by ACPI.
+
+#define INTI_POLARITY(flags) ((flags) & 3)
+#define INTI_TRIGGER(flags)  (((flags) >> 2) & 3)
+#define INTI_ACTIVE_LOW 3
+#define INTI_LEVEL      3
+
+#define NO_PIN 0xff
+
+static uint32 isa_irq_gsi[16];
+static uint16 isa_irq_flags[16];
+static uint8 isa_irq_pin[16];
+static uint32 isa_irq_redir[16]; // low word of the redirection entry
+static bool has_imcr; // IMCR must be set to connect the INTR line to the APIC
+
+bool irqs_use_ioapic;
+
+static void set_isa_irq (uint32 irq, uint32 gsi, uint16 flags)
+{
+  if (irq < 16)
+    {
+      isa_irq_gsi[irq] = gsi;
+      isa_irq_flags[irq] = flags;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Search for the BIOS tables.
+
+static bool has_signature (uint8* p, const char* sig, int len)
+{
+  for (int i = 0; i < len; i++)
+    if (p[i] != CAST(uint8,sig[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+static bool checksum_ok (uint8* p, uint32 len)
+{
+  uint8 sum = 0;
+
+  for (uint32 i = 0; i < len; i++)
+    sum += p[i];
+
+  return sum == 0;
+}
+
+static uint8* scan (uint32 start, uint32 len, const char* sig, int sig_len,
+                    uint32 sum_len)
+{
+  for (uint32 a = start; a < start + len; a += 16)
+    {
+      uint8* p = CAST(uint8*,a);
+
+      if (has_signature (p, sig, sig_len) && checksum_ok (p, sum_len))
+        return p;
+    }
+
+  return NULL;
+}
+
+static uint8* find_bios_table (const char* sig, int sig_len, uint32 sum_len)
+{
+  uint32 ebda = CAST(uint32,*fixed_address(uint16*,0x40e)) << 4;
+  uint8* p = NULL;
+
+  if (ebda != 0)
+    p = scan (ebda, 1024, sig, sig_len, sum_len);
+
+  if (p == NULL)
+    p = scan (0xe0000, 0x20000, sig, sig_len, sum_len);
+
+  return p;
+}
+
+//-----------------------------------------------------------------------------
+
+// MP configuration table.
+
+#define MP_PROCESSOR        0 // entry types
+#define MP_BUS              1
+#define MP_IOAPIC           2
+#define MP_IO_INTERRUPT     3
+#define MP_LOCAL_INTERRUPT  4
+
+#define MP_INT              0 // vectored interrupt
+#define MP_IOAPIC_ENABLED   1
+#define MP_IMCR_PRESENT     0x80
+
+static bool parse_mp_table ()
+{
+  uint8* fp = find_bios_table ("_MP_", 4, 16);
+
+  if (fp == NULL)
+    return FALSE;
+
+  uint8* cfg = CAST(uint8*,*CAST(uint32*,fp+4));
+
+  // Only systems with a configuration table are supported (not the
+  // "default configurations").
+
+  if (cfg == NULL || !has_signature (cfg, "PCMP", 4))
+    return FALSE;
+
+  has_imcr = (fp[12] & MP_IMCR_PRESENT) != 0;
+
+  uint32 nb_entries = *CAST(uint16*,cfg+34);
+  uint8* e = cfg + 44;
+  uint32 isa_bus = NO_PIN;
+  uint32 ioapic_id = NO_PIN;
+
+  for (uint32 i = 0; i < nb_entries; i++)
+    switch (e[0])
+      {
+      case MP_PROCESSOR:
+        e += 20;
+        break;
+
+      case MP_BUS:
+        if (has_signature (e+2, "ISA", 3))
+          isa_bus = e[1];
+        e += 8;
+        break;
+
+      case MP_IOAPIC:
+        if (ioapic_base == NULL && (e[3] & MP_IOAPIC_ENABLED))
+          {
+            ioapic_base = CAST(volatile uint32*,*CAST(uint32*,e+4));
+            ioapic_gsi_base = 0;
+            ioapic_id = e[1];
+          }
+        e += 8;
+        break;
+
+      case MP_IO_INTERRUPT:
+        if (e[1] == MP_INT && e[4] == isa_bus
+            && (e[6] == ioapic_id || e[6] == 0xff))
+          set_isa_irq (e[5], e[7], *CAST(uint16*,e+2));
+        e += 8;
+        break;
+
+      case MP_LOCAL_INTERRUPT:
+        e += 8;
+        break;
+
+      default:
+        return ioapic_base != NULL; // unknown entry, stop here
+      }
+
+  return ioapic_base != NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+// ACPI multiple APIC description table (MADT).
+
+#define MADT_IOAPIC   1 // entry types
+#define MADT_OVERRIDE 2
+
+static uint8* find_madt ()
+{
+  uint8* rsdp = find_bios_table ("RSD PTR ", 8, 20);
+
+  if (rsdp == NULL)
+    return NULL;
+
+  uint8* rsdt = CAST(uint8*,*CAST(uint32*,rsdp+16));
+
+  if (!has_signature (rsdt, "RSDT", 4))
+    return NULL;
+
+  uint32 len = *CAST(uint32*,rsdt+4);
+
+  for (uint32 i = 36; i + 4 <= len; i += 4)
+    {
+      uint8* t = CAST(uint8*,*CAST(uint32*,rsdt+i));
+
+      if (has_signature (t, "APIC", 4))
+        return t;
+    }
+
+  return NULL;
+}
+
+static bool parse_madt ()
+{
+  uint8* madt = find_madt ();
+
+  if (madt == NULL)
+    return FALSE;
+
+  uint8* end = madt + *CAST(uint32*,madt+4);
+
+  // The I/O APIC which handles global system interrupt 0 is the one
+  // to which the ISA IRQs are connected.
+
+  for (uint8* e = madt + 44; e < end && e[1] != 0; e += e[1])
+    if (e[0] == MADT_IOAPIC
+        && (ioapic_base == NULL || *CAST(uint32*,e+8) == 0))
+      {
+        ioapic_base = CAST(volatile uint32*,*CAST(uint32*,e+4));
+        ioapic_gsi_base = *CAST(uint32*,e+8);
+      }
+
+  for (uint8* e = madt + 44; e < end && e[1] != 0; e += e[1])
+    if (e[0] == MADT_OVERRIDE && e[2] == 0) // ISA bus
+      set_isa_irq (e[3], *CAST(uint32*,e+4), *CAST(uint16*,e+8));
+
+  return ioapic_base != NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool setup_ioapic ()
+{
+  for (int irq = 0; irq < 16; irq++)
+    set_isa_irq (irq, irq, 0);
+
+  if (!parse_mp_table ())
+    {
+      ioapic_base = NULL;
+
+      for (int irq = 0; irq < 16; irq++)
+        set_isa_irq (irq, irq, 0);
+
+      if (!parse_madt ())
+        return FALSE;
+    }
+
+  if (has_imcr)
+    {
+      outb (0x70, 0x22); // select the IMCR
+      outb (0x01, 0x23); // INTR goes to the local APIC
+    }
+
+  uint32 nb_pins = IOAPIC_VER_MAX_REDIR(ioapic_read (IOAPIC_VER)) + 1;
+
+  for (uint32 pin = 0; pin < nb_pins; pin++)
+    ioapic_write (IOAPIC_REDTBL(pin), IOAPIC_REDIR_MASKED);
+
+  for (int irq = 0; irq < 16; irq++)
+    {
+      uint32 pin = isa_irq_gsi[irq] - ioapic_gsi_base;
+      uint16 flags = isa_irq_flags[irq];
+
+      isa_irq_pin[irq] = NO_PIN;
+
+      if (irq == 2 || pin >= nb_pins) // IRQ2 is the PIC cascade
+        continue;
+
+      uint32 redir = (IRQ0_VECTOR + irq)
+                     | IOAPIC_REDIR_FIXED
+                     | IOAPIC_REDIR_MASKED;
+
+      if (INTI_POLARITY(flags) == INTI_ACTIVE_LOW)
+        redir |= IOAPIC_REDIR_LOW;
+
+      if (INTI_TRIGGER(flags) == INTI_LEVEL)
+        redir |= IOAPIC_REDIR_LEVEL;
+
+      isa_irq_pin[irq] = pin;
+      isa_irq_redir[irq] = redir;
+
+      ioapic_write (IOAPIC_REDTBL(pin)+1, IOAPIC_REDIR_DEST(apic_id ()));
+      ioapic_write (IOAPIC_REDTBL(pin), redir);
+    }
+
+  // From now on the PICs are not used.
+
+  pic_master_mask = 0xff;
+  pic_slave_mask = 0xff;
+  outb (pic_master_mask, PIC_PORT_MASTER_OCW1);
+  outb (pic_slave_mask, PIC_PORT_SLAVE_OCW1);
+
+  irqs_use_ioapic = TRUE;
+
+  return TRUE;
+}
+
+static void set_redir (int irq, uint32 redir)
+{
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (isa_irq_pin[irq] != NO_PIN)
+    {
+      isa_irq_redir[irq] = redir;
+      ioapic_write (IOAPIC_REDTBL(isa_irq_pin[irq]), redir);
+    }
+
+  restore_flags (flags);
+}
+
+void ioapic_mask_irq (int irq)
+{
+  set_redir (irq, isa_irq_redir[irq] | IOAPIC_REDIR_MASKED);
+}
+
+void ioapic_unmask_irq (int irq)
+{
+  set_redir (irq, isa_irq_redir[irq] & ~IOAPIC_REDIR_MASKED);
+}
+
+void ioapic_set_vector (int irq, uint32 vector)
+{
+  set_redir (irq, (isa_irq_redir[irq] & ~0xff) | vector);
+}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -135,6 +135,73 @@ all_video_modes_tried:
 
 #------------------------------------------------------------------------------
 
+detect_memory:
+
+# Get the physical memory map from the BIOS (INT 15h, function E820h).
+# This has to be done while we are still in 16 bit real mode.  Each
+# entry of the map is 24 bytes long: a 64 bit base address, a 64 bit
+# length, a 32 bit type (1 = usable RAM) and 32 bit ACPI extended
+# attributes.  If the BIOS does not support function E820h, function
+# 88h is used to get the amount of memory above 1MB, which is recorded
+# as a single usable entry.
+
+MEM_MAP_ENTRY_SIZE  = 24
+MEM_MAP_MAX_ENTRIES = 32
+SMAP                = 0x534d4150  # "SMAP"
+
+  movw  $((mem_map-kernel_entry+KERNEL_START)>>4)&0xffff,%ax
+  movw  %ax,%es
+  movw  $(mem_map-kernel_entry+KERNEL_START)&0xf,%di
+  xorl  %ebx,%ebx  # continuation value is 0 for the first call
+  xorw  %bp,%bp    # number of entries obtained
+
+next_mem_map_entry:
+
+  movl  $0xe820,%eax # select BIOS function: "Query System Address Map"
+  movl  $MEM_MAP_ENTRY_SIZE,%ecx
+  movl  $SMAP,%edx
+  movl  $1,%es:20(%di) # in case the BIOS only returns 20 bytes
+  int   $0x15  # call BIOS
+
+  jc    mem_map_done  # carry is set at end of map or if unsupported
+  cmpl  $SMAP,%eax
+  jne   mem_map_done
+
+  incw  %bp
+  addw  $MEM_MAP_ENTRY_SIZE,%di
+  cmpw  $MEM_MAP_MAX_ENTRIES,%bp
+  je    mem_map_done
+
+  testl %ebx,%ebx  # continuation value is 0 after the last entry
+  jne   next_mem_map_entry
+
+mem_map_done:
+
+  movw  $(mem_map-kernel_entry+KERNEL_START)&0xf,%di
+
+  testw %bp,%bp
+  jne   mem_map_store_count
+
+  movb  $0x88,%ah # select BIOS function: "Get Extended Memory Size"
+  int   $0x15  # call BIOS
+  jc    mem_map_store_count
+
+  movzwl %ax,%eax  # %eax = number of KB above 1MB
+  shll  $10,%eax
+  movl  $0x100000,%es:0(%di)
+  movl  $0,%es:4(%di)
+  movl  %eax,%es:8(%di)
+  movl  $0,%es:12(%di)
+  movl  $1,%es:16(%di)
+  movl  $1,%es:20(%di)
+  incw  %bp
+
+mem_map_store_count:
+
+  movw  %bp,%es:(mem_map_count-mem_map)(%di)
+
+#------------------------------------------------------------------------------
+
 # Physical memory map:
 #
 #            +------------+
@@ -418,117 +485,14 @@ INT15_INTR = 15
   movl  %eax,%es:8*INT15_INTR+0
   movl  %ebx,%es:8*INT15_INTR+4
 
-IRQ0_INTR = 0xb0
-
-  movl  $irq0_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ0_INTR+0
-  movl  %ebx,%es:8*IRQ0_INTR+4
-
-IRQ1_INTR = 0xb1
+IRQ0_INTR = 0xb0 # IRQ0 to IRQ15 use vectors 0xb0 to 0xbf
 
-  movl  $irq1_intr,%ebx
+  .irp  n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+  movl  $irq\n\()_intr,%ebx
   call  gen_intr_descr
-  movl  %eax,%es:8*IRQ1_INTR+0
-  movl  %ebx,%es:8*IRQ1_INTR+4
-
-IRQ2_INTR = 0xb2
-
-  movl  $irq2_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ2_INTR+0
-  movl  %ebx,%es:8*IRQ2_INTR+4
-
-IRQ3_INTR = 0xb3
-
-  movl  $irq3_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ3_INTR+0
-  movl  %ebx,%es:8*IRQ3_INTR+4
-
-IRQ4_INTR = 0xb4
-
-  movl  $irq4_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ4_INTR+0
-  movl  %ebx,%es:8*IRQ4_INTR+4
-
-IRQ5_INTR = 0xb5
-
-  movl  $irq5_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ5_INTR+0
-  movl  %ebx,%es:8*IRQ5_INTR+4
-
-IRQ6_INTR = 0xb6
-
-  movl  $irq6_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ6_INTR+0
-  movl  %ebx,%es:8*IRQ6_INTR+4
-
-IRQ7_INTR = 0xb7
-
-  movl  $irq7_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ7_INTR+0
-  movl  %ebx,%es:8*IRQ7_INTR+4
-
-IRQ8_INTR = 0xb8
-
-  movl  $irq8_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ8_INTR+0
-  movl  %ebx,%es:8*IRQ8_INTR+4
-
-IRQ9_INTR = 0xb9
-
-  movl  $irq9_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ9_INTR+0
-  movl  %ebx,%es:8*IRQ9_INTR+4
-
-IRQ10_INTR = 0xba
-
-  movl  $irq10_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ10_INTR+0
-  movl  %ebx,%es:8*IRQ10_INTR+4
-
-IRQ11_INTR = 0xbb
-
-  movl  $irq11_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ11_INTR+0
-  movl  %ebx,%es:8*IRQ11_INTR+4
-
-IRQ12_INTR = 0xbc
-
-  movl  $irq12_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ12_INTR+0
-  movl  %ebx,%es:8*IRQ12_INTR+4
-
-IRQ13_INTR = 0xbd
-
-  movl  $irq13_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ13_INTR+0
-  movl  %ebx,%es:8*IRQ13_INTR+4
-
-IRQ14_INTR = 0xbe
-
-  movl  $irq14_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ14_INTR+0
-  movl  %ebx,%es:8*IRQ14_INTR+4
-
-IRQ15_INTR = 0xbf
-
-  movl  $irq15_intr,%ebx
-  call  gen_intr_descr
-  movl  %eax,%es:8*IRQ15_INTR+0
-  movl  %ebx,%es:8*IRQ15_INTR+4
+  movl  %eax,%es:8*(IRQ0_INTR+\n)+0
+  movl  %ebx,%es:8*(IRQ0_INTR+\n)+4
+  .endr
 
 APIC_TIMER_INTR = 0xa0
 
@@ -670,7 +634,9 @@ init_paging:
 #  U/S (user/supervisor) U/S=0 for supervisor, U/S=1 for user
 #  R/W (read/write) R/W=0 for read-only, R/W=1 for read/write permission
 
-# >>> Not yet implemented!
+# Paging is turned on later by the C function "setup_paging" (see
+# "page.cpp"), which builds the page directory at PAGE_DIR using the
+# page allocator for the page-tables.
 
 #------------------------------------------------------------------------------
 
@@ -896,367 +862,108 @@ show_intr:
 
 # Trampolines into interrupt handlers written in C.
 
-irq0_intr:
-
-  .globl irq0
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq0
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq1_intr:
-
-  .globl irq1
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq1
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq2_intr:
-
-  .globl irq2
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq2
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq3_intr:
-
-  .globl irq3
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq3
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq4_intr:
-
-  .globl irq4
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq4
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq5_intr:
-
-  .globl irq5
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq5
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq6_intr:
-
-  .globl irq6
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq6
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq7_intr:
-
-  .globl irq7
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq7
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq8_intr:
-
-  .globl irq8
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq8
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq9_intr:
-
-  .globl irq9
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq9
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq10_intr:
-
-  .globl irq10
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq10
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq11_intr:
-
-  .globl irq11
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq11
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq12_intr:
-
-  .globl irq12
-
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq12
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
-
-irq13_intr:
+# All the IRQs go through the same trampoline, which passes the IRQ
+# number to "irq_dispatch".  This function calls the handlers that
+# were registered for the IRQ with "register_irq_handler".
+#
+# The handlers run on the interrupt stack.  The trampoline switches
+# to it unless the IRQ interrupted another IRQ (which is already on
+# it).  The interrupted stack pointer is kept in %ebx, which is
+# preserved by C functions.
+#
+# The C code expects the direction flag to be clear, so the
+# trampolines clear it in case the IRQ interrupted code which had set
+# it (the interrupted flags are restored by "iret").
+#
+# The registers are saved with "pushal" so that a preemption can
+# reuse them: "irq_return" completes the frame in the format of
+# "save_context" on the thread stack and switches to the next thread
+# directly, so a preemptive context switch saves and restores the
+# registers only once.
+
+  .globl irq_dispatch
+  .globl irq_preempt
+  .globl irq_resume_thread
+  .globl irq_stack_top
+  .globl irq_stack_depth
+
+  .macro SWITCH_TO_IRQ_STACK
+  movl  %esp,%ebx
+  incl  irq_stack_depth
+  cmpl  $1,irq_stack_depth
+  jne   1f
+  movl  irq_stack_top,%esp
+1:
+  .endm
+
+  .macro IRQ_TRAMPOLINE n
+irq\n\()_intr:
+  cld
+  pushal
+  SWITCH_TO_IRQ_STACK
+  pushl $\n
+  call  irq_dispatch
+  jmp   irq_return
+  .endm
+
+  .irp  n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+  IRQ_TRAMPOLINE \n
+  .endr
 
-  .globl irq13
+APIC_timer_intr:
 
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq13
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
-  iret
+  .globl APIC_timer_irq
 
-irq14_intr:
+  cld
+  pushal
+  SWITCH_TO_IRQ_STACK
+  call  APIC_timer_irq
+  jmp   irq_return
 
-  .globl irq14
+# On entry %al is nonzero when the interrupted thread must be preempted.
 
-  pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq14
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
+irq_return:
+  movl  %ebx,%esp  # back to the interrupted stack
+  decl  irq_stack_depth
+  testb %al,%al
+  jnz   irq_preempt_thread
+  popal
   iret
 
-irq15_intr:
-
-  .globl irq15
-
+irq_preempt_thread:
+  pushl $0               # The fourth parameter of "irq_preempt"
+  lea   -16(%esp),%eax   # The third parameter of "irq_preempt"
   pushl %eax
-  pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  irq15
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
-  popl  %ebx
-  popl  %eax
+  pushfl                 # The second parameter of "irq_preempt"
+  pushl %cs              # The first parameter of "irq_preempt"
+  call  irq_preempt      # The ``ret'' in ``restore_context'' comes
+  addl  $16,%esp         #  back here; remove the parameters
+  call  irq_resume_thread
+  popal
   iret
 
-APIC_timer_intr:
+# "irq_exit" runs the deferred work with this function, so that the
+# bottom halves also run on the interrupt stack when the work is done
+# by "preempt_enable" on a thread stack.  Interrupts are disabled on
+# entry and the result of "run_deferred_work" is returned in %eax.
 
-  .globl APIC_timer_irq
+  .globl run_deferred_work
+  .globl run_deferred_work_on_irq_stack
 
-  pushl %eax
+run_deferred_work_on_irq_stack:
   pushl %ebx
-  pushl %ecx
-  pushl %edx
-  pushl %esi
-  pushl %edi
-  pushl %ebp
-  call  APIC_timer_irq
-  popl  %ebp
-  popl  %edi
-  popl  %esi
-  popl  %edx
-  popl  %ecx
+  SWITCH_TO_IRQ_STACK
+  call  run_deferred_work
+  movl  %ebx,%esp  # back to the thread stack
+  decl  irq_stack_depth
   popl  %ebx
-  popl  %eax
-  iret
+  ret
 
 APIC_spurious_intr:
 
   .globl APIC_spurious_irq
 
+  cld
   pushl %eax
   pushl %ebx
   pushl %ecx
@@ -1356,4 +1063,16 @@ MaxPixelClock:         .space 4
 modes:
   .space 1024
 
+  .align 4
+
+  .globl mem_map
+
+mem_map:
+  .space 24*32  # MEM_MAP_ENTRY_SIZE*MEM_MAP_MAX_ENTRIES
+
+  .globl mem_map_count
+
+mem_map_count:
+  .long 0
+
 #------------------------------------------------------------------------------
@@ -435,6 +435,9 @@ void referee::run ()
 
   (new input_controller (_referee_events))->start ();
 
+  _players[0]->set_priority (low_priority);
+  _players[1]->set_priority (low_priority);
+
   _players[0]->start ();
   _players[1]->start ();
 
@@ -524,6 +527,8 @@ int main ()
   cpu_load* t1 = new cpu_load;
   referee* t2 = new referee;
 
+  t2->set_priority (high_priority);
+
   t1->start ();
   t2->start ();
 
@@ -0,0 +1,573 @@
+// file: "page.cpp"
+
+// Copyright (c) 2001 by Marc Feeley and Universit de Montral, All
+// Rights Reserved.
+//
+// Revision History
+// 18 Oct 26  initial version
+
+//-----------------------------------------------------------------------------
+
+#include "page.h"
+#include "asm.h"
+#include "kernel.h"
+#include "rtlib.h"
+#include "term.h"
+
+//-----------------------------------------------------------------------------
+
+// Binary buddy allocator.  Free memory is kept as blocks of 2^order
+// pages (order 0 to PAGE_MAX_ORDER) which are aligned on their size,
+// in one doubly-linked free list per order.  The list links are stored
+// in the first page of each free block.  A table with one byte per
+// page frame records which frames are the head of a free block and
+// the order of that block, so that the buddy of a freed block can be
+// found and coalesced with it in constant time.
+//
+// Allocations are not rounded up to a power of two: the pages beyond
+// "npages" in the block that is taken are freed immediately, and
+// "free_pages" frees any range of pages by splitting it into aligned
+// blocks.
+
+struct free_block
+  {
+    free_block* next;
+    free_block* prev;
+  };
+
+#define FRAME_FREE_HEAD 0x80 // frame is the head of a free block
+
+static free_block* free_lists[PAGE_MAX_ORDER+1];
+static uint8* frames;  // state of each page frame
+static uint32 nb_frames;
+
+uint32 _ram_kb;
+uint32 _usable_pages;
+uint32 _free_pages;
+uint32 _free_blocks[PAGE_MAX_ORDER+1];
+
+#define frame_of(ptr) (CAST(uint32,ptr) / PAGE_SIZE)
+#define block_at(frame) CAST(free_block*,(frame) * PAGE_SIZE)
+
+static void add_free_block (uint32 frame, uint8 order)
+{
+  free_block* b = block_at (frame);
+  free_block* head = free_lists[order];
+
+  b->prev = NULL;
+  b->next = head;
+  if (head != NULL)
+    head->prev = b;
+  free_lists[order] = b;
+
+  frames[frame] = FRAME_FREE_HEAD | order;
+  _free_blocks[order]++;
+}
+
+static void remove_free_block (uint32 frame, uint8 order)
+{
+  free_block* b = block_at (frame);
+
+  if (b->prev == NULL)
+    free_lists[order] = b->next;
+  else
+    b->prev->next = b->next;
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+
+  frames[frame] = 0;
+  _free_blocks[order]--;
+}
+
+static void free_block_locked (uint32 frame, uint8 order)
+{
+  // Coalesce with the buddy as long as it is a free block of the
+  // same order.
+
+  while (order < PAGE_MAX_ORDER)
+    {
+      uint32 buddy = frame ^ (CAST(uint32,1) << order);
+
+      if (buddy >= nb_frames || frames[buddy] != (FRAME_FREE_HEAD | order))
+        break;
+
+      remove_free_block (buddy, order);
+      frame &= ~(CAST(uint32,1) << order);
+      order++;
+    }
+
+  add_free_block (frame, order);
+}
+
+static void free_range_locked (uint32 frame, uint32 npages)
+{
+  _free_pages += npages;
+
+  while (npages > 0)
+    {
+      // largest block aligned on "frame" that fits in the range
+
+      uint8 order = 0;
+
+      while (order < PAGE_MAX_ORDER
+             && (frame & (CAST(uint32,1) << order)) == 0
+             && (CAST(uint32,2) << order) <= npages)
+        order++;
+
+      free_block_locked (frame, order);
+
+      frame += CAST(uint32,1) << order;
+      npages -= CAST(uint32,1) << order;
+    }
+}
+
+void* alloc_pages (uint32 npages)
+{
+  if (npages == 0 || npages > (CAST(uint32,1) << PAGE_MAX_ORDER))
+    return NULL;
+
+  uint8 order = 0;
+
+  while ((CAST(uint32,1) << order) < npages)
+    order++;
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+  uint8 o = order;
+
+  while (o <= PAGE_MAX_ORDER && free_lists[o] == NULL)
+    o++;
+
+  void* result = NULL;
+
+  if (o <= PAGE_MAX_ORDER)
+    {
+      uint32 frame = frame_of (free_lists[o]);
+
+      remove_free_block (frame, o);
+
+      while (o > order) // split, keeping the lower half
+        {
+          o--;
+          add_free_block (frame + (CAST(uint32,1) << o), o);
+        }
+
+      _free_pages -= CAST(uint32,1) << order;
+
+      if (npages < (CAST(uint32,1) << order)) // give back the excess
+        free_range_locked (frame + npages,
+                           (CAST(uint32,1) << order) - npages);
+
+      result = block_at (frame);
+    }
+
+  restore_flags (flags);
+
+  return result;
+}
+
+void free_pages (void* ptr, uint32 npages)
+{
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  free_range_locked (frame_of (ptr), npages);
+
+  restore_flags (flags);
+}
+
+//-----------------------------------------------------------------------------
+
+// Fragmentation statistics.  The fragmentation is the percentage of
+// the free memory which is not part of the largest free block, so it
+// is 0 when all the free memory could be allocated in one request.
+
+uint32 largest_free_block ()
+{
+  int order = PAGE_MAX_ORDER;
+
+  while (order >= 0 && _free_blocks[order] == 0)
+    order--;
+
+  return (order < 0) ? 0 : CAST(uint32,1) << order;
+}
+
+uint32 page_fragmentation ()
+{
+  if (_free_pages == 0)
+    return 0;
+
+  return 100 - largest_free_block () * 100 / _free_pages;
+}
+
+void report_pages ()
+{
+  cout << "free pages = " << _free_pages << " of " << _usable_pages
+       << ", fragmentation = " << page_fragmentation () << "%\n";
+
+  for (int order = 0; order <= PAGE_MAX_ORDER; order++)
+    if (_free_blocks[order] != 0)
+      cout << "  order " << order << ": " << _free_blocks[order]
+           << " blocks\n";
+}
+
+//-----------------------------------------------------------------------------
+
+// Paging.
+
+#define PG_PRESENT (1<<0)
+#define PG_WRITE   (1<<1)
+#define PG_PWT     (1<<3) // page write-through
+#define PG_PCD     (1<<4) // page cache disabled
+#define PG_LARGE   (1<<7) // 4MB page (in page directory entries)
+
+#define PG_FRAME_MASK (~CAST(uint32,PAGE_SIZE-1))
+#define PG_LARGE_MASK (~CAST(uint32,(1<<22)-1))
+
+#define APIC_DIR (0xfec00000 >> 22) // the local APIC and I/O APIC are there
+
+static uint32* new_page_table (uint32 base, uint32 attr)
+{
+  uint32* table = CAST(uint32*,alloc_pages (1));
+
+  if (table == NULL)
+    fatal_error ("not enough memory for page tables");
+
+  for (uint32 i = 0; i < 1024; i++)
+    table[i] = (base + i * PAGE_SIZE) | attr;
+
+  return table;
+}
+
+void setup_paging ()
+{
+  uint32* dir = CAST(uint32*,PAGE_DIR);
+  uint32 dummy, features;
+
+  cpuid (1, dummy, dummy, dummy, features);
+
+  // The 4MB at APIC_DIR hold the local APIC and the I/O APIC
+  // registers, and the topmost 4MB hold the BIOS ROM, so they are
+  // not cached.
+
+  if (features & HAS_PSE)
+    {
+      for (uint32 i = 0; i < 1024; i++)
+        dir[i] = (i << 22) | PG_LARGE | PG_WRITE | PG_PRESENT
+                 | ((i == APIC_DIR || i == 1023) ? PG_PCD | PG_PWT : 0);
+
+      set_cr4 (cr4_reg () | CR4_PSE);
+    }
+  else
+    {
+      // Without 4MB pages, a page-table is needed for every 4MB, so
+      // only the RAM, the APICs and the topmost 4MB are mapped.
+
+      uint32 ram_dirs = (nb_frames + 1023) / 1024;
+
+      for (uint32 i = 0; i < 1024; i++)
+        if (i < ram_dirs || i == APIC_DIR || i == 1023)
+          {
+            uint32 attr = PG_WRITE | PG_PRESENT
+                          | ((i >= ram_dirs) ? PG_PCD | PG_PWT : 0);
+            dir[i] = CAST(uint32,new_page_table (i << 22, attr))
+                     | PG_WRITE | PG_PRESENT;
+          }
+        else
+          dir[i] = 0;
+    }
+
+  set_cr3 (PAGE_DIR);
+  set_cr0 (cr0_reg () | CR0_PG);
+}
+
+static void change_page_flags (uint32 addr, uint32 set, uint32 clear)
+{
+  uint32* dir = CAST(uint32*,PAGE_DIR);
+  uint32 pde = dir[addr >> 22];
+
+  if (pde & PG_LARGE)
+    {
+      // Split the 4MB page into 4KB pages with the same attributes.
+
+      uint32 attr = pde & (PG_PCD | PG_PWT | PG_WRITE | PG_PRESENT);
+      uint32* table = new_page_table (pde & PG_LARGE_MASK, attr);
+
+      pde = CAST(uint32,table) | PG_WRITE | PG_PRESENT;
+      dir[addr >> 22] = pde;
+      invlpg (addr & PG_LARGE_MASK);
+    }
+
+  if (pde & PG_PRESENT)
+    {
+      uint32* pte = CAST(uint32*,pde & PG_FRAME_MASK) + ((addr >> 12) & 1023);
+
+      *pte = (*pte & ~clear) | set;
+
+      invlpg (addr);
+    }
+}
+
+void set_page_present (void* ptr, bool present)
+{
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (present)
+    change_page_flags (CAST(uint32,ptr), PG_PRESENT, 0);
+  else
+    change_page_flags (CAST(uint32,ptr), 0, PG_PRESENT);
+
+  restore_flags (flags);
+}
+
+bool page_present (void* ptr)
+{
+  uint32 addr = CAST(uint32,ptr);
+  uint32 pde = CAST(uint32*,PAGE_DIR)[addr >> 22];
+
+  if ((pde & PG_PRESENT) == 0)
+    return FALSE;
+
+  if (pde & PG_LARGE)
+    return TRUE;
+
+  return (CAST(uint32*,pde & PG_FRAME_MASK)[(addr >> 12) & 1023]
+          & PG_PRESENT) != 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// Write-combining.
+//
+// With a page attribute table (PAT), entry 1 of the table, which is
+// selected by pages with PWT=1 and PCD=0, is changed from
+// write-through to write-combining, and the pages of the region are
+// given that combination.  Whole 4MB pages are changed in place,
+// other pages are changed individually.  Without a PAT, a fixed range
+// MTRR is used for the VGA window (0xa0000 to 0xbffff) and a variable
+// range MTRR for other regions, which must then be a power of two in
+// size and aligned on their size.  Both methods follow the procedure
+// required by the processor: caches are flushed before and after the
+// change of memory type.
+
+static bool pat_has_wc = FALSE;
+
+static bool pat_write_combining (uint32 start, uint32 end)
+{
+  uint32* dir = CAST(uint32*,PAGE_DIR);
+
+  if (!pat_has_wc)
+    {
+      uint64 pat = rdmsr (MSR_PAT);
+      pat = (pat & ~(CAST(uint64,0xff) << 8))
+            | (CAST(uint64,MEM_TYPE_WC) << 8);
+      wbinvd ();
+      wrmsr (MSR_PAT, pat);
+      pat_has_wc = TRUE;
+    }
+
+  wbinvd ();
+
+  while (start < end)
+    {
+      uint32* pde = &dir[start >> 22];
+
+      if ((start & ~PG_LARGE_MASK) == 0
+          && end - start >= (1<<22)
+          && (*pde & PG_LARGE))
+        {
+          *pde = (*pde & ~PG_PCD) | PG_PWT;
+          invlpg (start);
+          start += 1<<22;
+        }
+      else
+        {
+          change_page_flags (start, PG_PWT, PG_PCD);
+          start += PAGE_SIZE;
+        }
+    }
+
+  wbinvd ();
+
+  return TRUE;
+}
+
+static bool mtrr_write_combining (uint32 start, uint32 end)
+{
+  uint64 cap = rdmsr (MSR_MTRRCAP);
+  uint64 def_type = rdmsr (MSR_MTRR_DEF_TYPE);
+  uint32 size = end - start;
+  int fixed = -1;
+  int var = -1;
+
+  if ((cap & MTRRCAP_WC) == 0 || (def_type & MTRR_DEF_TYPE_E) == 0)
+    return FALSE;
+
+  if (start >= 0xa0000 && end <= 0xc0000)
+    {
+      if ((cap & MTRRCAP_FIX) == 0 || (def_type & MTRR_DEF_TYPE_FE) == 0)
+        return FALSE;
+      fixed = 1;
+    }
+  else
+    {
+      if ((size & (size-1)) != 0 || (start & (size-1)) != 0)
+        return FALSE; // not representable with one variable range MTRR
+
+      for (int i = (cap & MTRRCAP_VCNT_MASK) - 1; i >= 0; i--)
+        if ((rdmsr (MSR_MTRR_PHYSMASK(i)) & MTRR_PHYSMASK_V) == 0)
+          var = i;
+
+      if (var < 0)
+        return FALSE; // all variable range MTRRs are in use
+    }
+
+  uint32 cr0 = cr0_reg ();
+
+  set_cr0 ((cr0 | CR0_CD) & ~CR0_NW); // enter no-fill cache mode
+  wbinvd ();
+  wrmsr (MSR_MTRR_DEF_TYPE, def_type & ~MTRR_DEF_TYPE_E);
+
+  if (fixed >= 0)
+    {
+      // one byte per 16KB range, from 0xa0000 to 0xbffff
+
+      uint64 types = rdmsr (MSR_MTRR_FIX16K_A0000);
+
+      for (uint32 a = start & ~0x3fff; a < end; a += 0x4000)
+        {
+          int shift = ((a - 0xa0000) >> 14) * 8;
+          types = (types & ~(CAST(uint64,0xff) << shift))
+                  | (CAST(uint64,MEM_TYPE_WC) << shift);
+        }
+
+      wrmsr (MSR_MTRR_FIX16K_A0000, types);
+    }
+  else
+    {
+      const uint64 phys_mask = (CAST(uint64,1) << 36) - 1; // 36 bit addresses
+
+      wrmsr (MSR_MTRR_PHYSBASE(var), CAST(uint64,start) | MEM_TYPE_WC);
+      wrmsr (MSR_MTRR_PHYSMASK(var),
+             (~CAST(uint64,size-1) & phys_mask & ~CAST(uint64,0xfff))
+             | MTRR_PHYSMASK_V);
+    }
+
+  wbinvd ();
+  wrmsr (MSR_MTRR_DEF_TYPE, def_type);
+  set_cr0 (cr0);
+
+  return TRUE;
+}
+
+bool set_write_combining (void* ptr, uint32 size)
+{
+  uint32 start = CAST(uint32,ptr) & PG_FRAME_MASK;
+  uint32 end = (CAST(uint32,ptr) + size + PAGE_SIZE - 1) & PG_FRAME_MASK;
+  bool result = FALSE;
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (_cpu_features & HAS_PAT)
+    result = pat_write_combining (start, end);
+  else if (_cpu_features & HAS_MTRR)
+    result = mtrr_write_combining (start, end);
+
+  restore_flags (flags);
+
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+// The usable ranges of the BIOS memory map are clipped to the region
+// from 1MB to just below 4GB and trimmed to page boundaries.  The
+// memory below 1MB holds the kernel and system tables.
+
+static bool usable_range (mem_map_entry* e, uint32* first, uint32* last)
+{
+  const uint64 low = 1<<20;
+  const uint64 high = (CAST(uint64,1)<<32) - PAGE_SIZE; // keep ends in 32 bits
+  uint64 start = e->base;
+  uint64 end = e->base + e->length;
+
+  if (e->type != MEM_MAP_USABLE)
+    return FALSE;
+
+  if (start < low)
+    start = low;
+  if (end > high)
+    end = high;
+
+  start = (start + PAGE_SIZE - 1) & ~CAST(uint64,PAGE_SIZE - 1);
+  end &= ~CAST(uint64,PAGE_SIZE - 1);
+
+  if (start >= end)
+    return FALSE;
+
+  *first = start / PAGE_SIZE;
+  *last = end / PAGE_SIZE;
+
+  return TRUE;
+}
+
+void setup_pages ()
+{
+  uint64 ram = 0;
+  uint32 first;
+  uint32 last;
+  uint32 i;
+
+  nb_frames = 0;
+
+  for (i = 0; i < mem_map_count; i++)
+    {
+      mem_map_entry* e = &mem_map[i];
+
+      if (e->type == MEM_MAP_USABLE
+          || e->type == MEM_MAP_ACPI_RECLAIMABLE
+          || e->type == MEM_MAP_ACPI_NVS)
+        ram += e->length;
+
+      if (usable_range (e, &first, &last) && last > nb_frames)
+        nb_frames = last;
+    }
+
+  _ram_kb = ram >> 10;
+
+  // The frame table is taken from the start of the first usable range
+  // which is large enough to hold it.
+
+  uint32 table_pages = (nb_frames + PAGE_SIZE - 1) / PAGE_SIZE;
+  uint32 table_frame = 0;
+
+  frames = NULL;
+
+  for (i = 0; i < mem_map_count; i++)
+    if (usable_range (&mem_map[i], &first, &last)
+        && last - first > table_pages)
+      {
+        table_frame = first;
+        frames = CAST(uint8*,block_at (first));
+        break;
+      }
+
+  if (frames == NULL)
+    fatal_error ("not enough memory for the page frame table");
+
+  for (i = 0; i < nb_frames; i++)
+    frames[i] = 0;
+
+  for (i = 0; i < mem_map_count; i++)
+    if (usable_range (&mem_map[i], &first, &last))
+      {
+        if (first == table_frame)
+          first += table_pages;
+        free_range_locked (first, last - first);
+      }
+
+  _usable_pages = _free_pages;
+}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -142,6 +142,8 @@ static condvar* circular_buffer_cv;
 
 static void keypress (uint8 ch)
 {
+  preempt_disable ();
+
   int next_hi = (circular_buffer_hi + 1) % BUFFER_SIZE;
 
   if (next_hi != circular_buffer_lo)
@@ -150,11 +152,13 @@ static void keypress (uint8 ch)
       circular_buffer_hi = next_hi;
       circular_buffer_cv->mutexless_signal ();
     }
+
+  preempt_enable ();
 }
 
 unicode_char getchar ()
 {
-  disable_interrupts ();
+  preempt_disable ();
 
   while (circular_buffer_lo == circular_buffer_hi)
     circular_buffer_cv->mutexless_wait ();
@@ -165,7 +169,7 @@ unicode_char getchar ()
 
   circular_buffer_cv->mutexless_signal ();
 
-  enable_interrupts ();
+  preempt_enable ();
 
   return result;
 }
@@ -199,15 +203,43 @@ static void process_keyboard_data (uint8 data)
 
 #ifdef USE_IRQ1_FOR_KEYBOARD
 
-void irq1 ()
+// The IRQ handler only reads the scancode.  The scancodes are
+// translated later, with interrupts enabled, by "keyboard_work".  The
+// keyboard has a low IRQ priority, so the handler runs with
+// interrupts enabled and can be interrupted by the other IRQs.
+
+static volatile uint8 scancode_buffer[BUFFER_SIZE];
+static volatile int scancode_buffer_lo = 0;
+static volatile int scancode_buffer_hi = 0;
+
+static void process_scancodes (void* arg)
 {
-#ifdef SHOW_INTERRUPTS
-  cout << "\033[41m irq1 \033[0m";
-#endif
+  while (scancode_buffer_lo != scancode_buffer_hi)
+    {
+      uint8 data = scancode_buffer[scancode_buffer_lo];
+      scancode_buffer_lo = (scancode_buffer_lo + 1) % BUFFER_SIZE;
+      process_keyboard_data (data);
+    }
+}
+
+static deferred_work keyboard_work = DEFERRED_WORK(process_scancodes, NULL);
+
+static void keyboard_irq (void* arg)
+{
+  uint8 data = inb (PS2_PORT_A);
+  int next_hi = (scancode_buffer_hi + 1) % BUFFER_SIZE;
+
+  if (next_hi != scancode_buffer_lo)
+    {
+      scancode_buffer[scancode_buffer_hi] = data;
+      scancode_buffer_hi = next_hi;
+    }
+
+  uint32 flags = save_flags_and_disable_interrupts ();
 
-  ACKNOWLEDGE_IRQ(1);
+  defer_work (&keyboard_work);
 
-  process_keyboard_data (inb (PS2_PORT_A));
+  restore_flags (flags);
 }
 
 #endif
@@ -225,6 +257,8 @@ void setup_ps2 ()
   controller_command (PS2_CMD_ENABLE_KEYBOARD);
 
 #ifdef USE_IRQ1_FOR_KEYBOARD
+  register_irq_handler (1, keyboard_irq, NULL);
+  set_irq_priority (1, IRQ_PRIO_LOW);
   ENABLE_IRQ(1);
 #endif
 }
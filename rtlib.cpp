@@ -9,6 +9,7 @@
 //-----------------------------------------------------------------------------
 
 #include "rtlib.h"
+#include "page.h"
 #include "intr.h"
 #include "time.h"
 #include "ps2.h"
@@ -83,22 +84,342 @@ uint8 log2 (uint32 n)
 
 // Memory management functions.
 
-// For now, a simple linear allocator is used.  Memory is never reclaimed.
+// Memory is handed out in pages of PAGE_SIZE bytes by the page
+// allocator.  Small objects (up to SLAB_MAX_OBJ bytes) are allocated
+// from slabs, which are single pages divided into objects of the same
+// size class (8, 16, 32, ..., 1024 bytes).  Larger objects are
+// allocated as runs of contiguous pages.  Both kinds of blocks start
+// with a header at the beginning of their first page, so "kfree" finds
+// the header by rounding the pointer down to a page boundary.  All
+// operations are done with interrupts disabled so that they can be
+// used anywhere.  "kmalloc" returns NULL when memory is exhausted.
+
+// Slabs.  The objects of a slab which have never been allocated are
+// carved out lazily from the end of the used part of the slab, and
+// freed objects are kept on a per-slab free list.  The slabs of a
+// size class which have free objects are kept on a doubly-linked
+// "partial" list.  At most one empty slab per size class is kept to
+// avoid repeatedly obtaining and releasing the same page; the others
+// are returned to the page pool.
+
+#define SLAB_MAGIC 0x51ab51ab
+#define LARGE_MAGIC 0x1a26eb1c
+#define NB_SIZE_CLASSES 8
+#define SLAB_MIN_OBJ 8
+#define SLAB_MAX_OBJ (SLAB_MIN_OBJ << (NB_SIZE_CLASSES-1))
+
+struct slab
+  {
+    uint32 magic;
+    uint16 size_class;
+    uint16 inuse;      // number of objects allocated
+    slab* next;        // links of "partial" list
+    slab* prev;
+    void* free_list;   // objects that were freed
+    uint32 carve;      // offset of the first never allocated object
+    uint32 padding[2]; // keep objects 8 byte aligned
+  };
+
+struct large_block
+  {
+    uint32 magic;
+    uint32 npages;
+    uint32 padding[2]; // keep objects 8 byte aligned
+  };
+
+static slab* partial_slabs[NB_SIZE_CLASSES];
+static uint32 empty_slabs[NB_SIZE_CLASSES];
+
+#define slab_obj_size(s) (SLAB_MIN_OBJ << (s)->size_class)
+#define slab_full(s) \
+((s)->free_list == NULL && (s)->carve + slab_obj_size (s) > PAGE_SIZE)
+
+static void slab_link (slab* s)
+{
+  slab* head = partial_slabs[s->size_class];
 
-static uint32 alloc_ptr = (1<<20); // start at 1MB
+  s->prev = NULL;
+  s->next = head;
+  if (head != NULL)
+    head->prev = s;
+  partial_slabs[s->size_class] = s;
+}
 
-void* kmalloc (size_t size)
+static void slab_unlink (slab* s)
+{
+  if (s->prev == NULL)
+    partial_slabs[s->size_class] = s->next;
+  else
+    s->prev->next = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+}
+
+static void* slab_alloc_locked (uint16 size_class)
+{
+  slab* s = partial_slabs[size_class];
+
+  if (s == NULL)
+    {
+      s = CAST(slab*,alloc_pages (1));
+      if (s == NULL)
+        return NULL;
+      s->magic = SLAB_MAGIC;
+      s->size_class = size_class;
+      s->inuse = 0;
+      s->free_list = NULL;
+      s->carve = sizeof (slab);
+      slab_link (s);
+      empty_slabs[size_class]++;
+    }
+
+  void* obj;
+
+  if (s->free_list != NULL)
+    {
+      obj = s->free_list;
+      s->free_list = *CAST(void**,obj);
+    }
+  else
+    {
+      obj = CAST(void*,CAST(uint32,s) + s->carve);
+      s->carve += slab_obj_size (s);
+    }
+
+  if (s->inuse++ == 0)
+    empty_slabs[size_class]--;
+
+  if (slab_full (s))
+    slab_unlink (s);
+
+  return obj;
+}
+
+static void slab_free_locked (slab* s, void* obj)
+{
+  if (slab_full (s))
+    slab_link (s);
+
+  *CAST(void**,obj) = s->free_list;
+  s->free_list = obj;
+
+  if (--s->inuse == 0)
+    {
+      if (empty_slabs[s->size_class] > 0)
+        {
+          slab_unlink (s);
+          free_pages (s, 1);
+        }
+      else
+        empty_slabs[s->size_class]++;
+    }
+}
+
+static void* heap_alloc (size_t size)
+{
+  void* result;
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (size <= SLAB_MAX_OBJ)
+    {
+      uint16 size_class = 0;
+
+      if (size > SLAB_MIN_OBJ)
+        size_class = log2 (size - 1) + 1 - log2 (SLAB_MIN_OBJ);
+
+      result = slab_alloc_locked (size_class);
+    }
+  else
+    {
+      uint32 npages =
+        (size + sizeof (large_block) + PAGE_SIZE - 1) / PAGE_SIZE;
+      large_block* b = CAST(large_block*,alloc_pages (npages));
+
+      if (b == NULL)
+        result = NULL;
+      else
+        {
+          b->magic = LARGE_MAGIC;
+          b->npages = npages;
+          result = b + 1;
+        }
+    }
+
+  restore_flags (flags);
+
+  return result;
+}
+
+static void heap_free (void* ptr)
+{
+  uint32 flags = save_flags_and_disable_interrupts ();
+  uint32 page = CAST(uint32,ptr) & ~(PAGE_SIZE-1);
+
+  if (CAST(slab*,page)->magic == SLAB_MAGIC)
+    slab_free_locked (CAST(slab*,page), ptr);
+  else if (CAST(large_block*,page)->magic == LARGE_MAGIC)
+    {
+      large_block* b = CAST(large_block*,page);
+      b->magic = 0;
+      free_pages (b, b->npages);
+    }
+  else
+    fatal_error ("kfree: invalid pointer");
+
+  restore_flags (flags);
+}
+
+// Heap instrumentation.
+//
+// When INSTRUMENT_HEAP is defined, each block is preceded by a tag
+// which records the size requested and the call site that allocated
+// it (the return address of "kmalloc" or of the "new" operator, so
+// the site of a "new" expression is the code that contains it).  For
+// each call site the number of allocations and the number of live
+// objects and bytes are maintained, as well as a histogram of the
+// allocation sizes (bucket "i" counts sizes from 2^i to 2^(i+1)-1).
+// "heap_report" shows the sites that have live objects.
+
+#ifdef INSTRUMENT_HEAP
+
+struct heap_site
+  {
+    void* caller;
+    uint32 nb_allocs;
+    uint32 live_objects;
+    uint32 live_bytes;
+  };
+
+struct heap_tag
+  {
+    heap_site* site;
+    uint32 size;
+  };
+
+#define NB_HEAP_SITES 256 // must be a power of 2
+
+static heap_site heap_sites[NB_HEAP_SITES+1]; // last one is for overflow
+static uint32 heap_size_histogram[32];
+
+static heap_site* heap_site_of (void* caller)
 {
-  uint32 ptr = alloc_ptr;
+  uint32 h = (CAST(uint32,caller) >> 2) & (NB_HEAP_SITES-1);
+
+  for (int i = 0; i < NB_HEAP_SITES; i++)
+    {
+      heap_site* s = &heap_sites[(h + i) & (NB_HEAP_SITES-1)];
 
-  alloc_ptr = ptr + ((size + 7) & ~7);
+      if (s->caller == caller)
+        return s;
 
-  return CAST(void*,ptr);
+      if (s->caller == NULL)
+        {
+          s->caller = caller;
+          return s;
+        }
+    }
+
+  return &heap_sites[NB_HEAP_SITES]; // table is full
+}
+
+void* kmalloc_at (size_t size, void* caller)
+{
+  heap_tag* tag = CAST(heap_tag*,heap_alloc (size + sizeof (heap_tag)));
+
+  if (tag == NULL)
+    return NULL;
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+  heap_site* s = heap_site_of (caller);
+
+  s->nb_allocs++;
+  s->live_objects++;
+  s->live_bytes += size;
+  heap_size_histogram[(size == 0) ? 0 : log2 (size)]++;
+
+  restore_flags (flags);
+
+  tag->site = s;
+  tag->size = size;
+
+  return tag + 1;
 }
 
 void kfree (void* ptr)
 {
-  // Not implemented yet.
+  if (ptr == NULL)
+    return;
+
+  heap_tag* tag = CAST(heap_tag*,ptr) - 1;
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  tag->site->live_objects--;
+  tag->site->live_bytes -= tag->size;
+
+  restore_flags (flags);
+
+  heap_free (tag);
+}
+
+void heap_report ()
+{
+  uint32 objects = 0;
+  uint32 bytes = 0;
+
+  cout << "heap: live objects per allocation site\n";
+
+  for (int i = 0; i <= NB_HEAP_SITES; i++)
+    {
+      heap_site* s = &heap_sites[i];
+
+      if (s->live_objects != 0)
+        {
+          cout << "  " << s->caller << ": " << s->live_objects
+               << " objects, " << s->live_bytes << " bytes ("
+               << s->nb_allocs << " allocations)\n";
+          objects += s->live_objects;
+          bytes += s->live_bytes;
+        }
+    }
+
+  cout << "  total: " << objects << " objects, " << bytes << " bytes\n";
+
+  cout << "heap: allocation sizes\n";
+
+  for (int i = 0; i < 32; i++)
+    if (heap_size_histogram[i] != 0)
+      cout << "  " << (CAST(uint32,1) << i) << "..: "
+           << heap_size_histogram[i] << "\n";
+}
+
+#else
+
+void* kmalloc_at (size_t size, void* caller)
+{
+  return heap_alloc (size);
+}
+
+void kfree (void* ptr)
+{
+  if (ptr != NULL)
+    heap_free (ptr);
+}
+
+#endif
+
+void* kmalloc (size_t size)
+{
+  return kmalloc_at (size, __builtin_return_address (0));
+}
+
+static void* new_at (size_t size, void* caller)
+{
+  void* obj = kmalloc_at (size, caller);
+
+  if (obj == NULL)
+    fatal_error ("out of memory");
+
+  return obj;
 }
 
 // Implementation of the C++ "new" operator.
@@ -109,7 +430,7 @@ void* __builtin_new (size_t size)
 void* operator new (size_t size)
 #endif
 {
-  return kmalloc (size);
+  return new_at (size, __builtin_return_address (0));
 }
 
 // Implementation of the C++ "delete" operator.
@@ -132,7 +453,7 @@ void* __builtin_vec_new (size_t size)
 void* operator new[] (size_t size)
 #endif
 {
-  return operator new (size);
+  return new_at (size, __builtin_return_address (0));
 }
 
 // Implementation of the C++ "delete[]" operator.
@@ -146,12 +467,291 @@ void operator delete[] (void* obj)
   operator delete (obj);
 }
 
+//-----------------------------------------------------------------------------
+
+// Memory copying and filling.
+//
+// The baseline routines use the string instructions ("rep movsl" and
+// "rep stosl").  On CPUs with MMX or SSE2, wide variants move 64 bytes
+// per iteration through the MMX or XMM registers.  The kernel does not
+// otherwise use the FPU and does not save its state on context
+// switches, so the wide loops run with interrupts disabled, in chunks
+// of at most WIDE_CHUNK bytes to bound the interrupt latency.  The
+// variant is selected once at boot by "setup_memory_routines"; until
+// then (for example while the BSS is cleared) the baseline is used.
+
+#define WIDE_MIN   256  // smaller blocks are handled by the baseline
+#define WIDE_CHUNK 4096
+
+static void* rep_memcpy (void* dest, const void* src, size_t n)
+{
+  uint32 d0, d1, d2;
+
+  __asm__ __volatile__ ("rep; movsl\n\t"
+                        "movl %4,%%ecx\n\t"
+                        "rep; movsb"
+                        : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+                        : "0" (n >> 2), "g" (n & 3), "1" (dest), "2" (src)
+                        : "memory");
+
+  return dest;
+}
+
+static void* rep_memset (void* dest, int c, size_t n)
+{
+  uint32 d0, d1;
+
+  __asm__ __volatile__ ("rep; stosl\n\t"
+                        "movl %3,%%ecx\n\t"
+                        "rep; stosb"
+                        : "=&c" (d0), "=&D" (d1)
+                        : "a" (CAST(uint8,c) * 0x01010101), "g" (n & 3),
+                          "0" (n >> 2), "1" (dest)
+                        : "memory");
+
+  return dest;
+}
+
+static void* mmx_memcpy (void* dest, const void* src, size_t n)
+{
+  uint8* d = CAST(uint8*,dest);
+  const uint8* s = CAST(const uint8*,src);
+
+  if (n >= WIDE_MIN)
+    while (n >= 64)
+      {
+        size_t chunk = (n > WIDE_CHUNK) ? WIDE_CHUNK : (n & ~63);
+        uint32 d0, d1, d2;
+        uint32 flags = save_flags_and_disable_interrupts ();
+
+        __asm__ __volatile__ ("1:\n\t"
+                              "movq   (%1),%%mm0\n\t"
+                              "movq  8(%1),%%mm1\n\t"
+                              "movq 16(%1),%%mm2\n\t"
+                              "movq 24(%1),%%mm3\n\t"
+                              "movq 32(%1),%%mm4\n\t"
+                              "movq 40(%1),%%mm5\n\t"
+                              "movq 48(%1),%%mm6\n\t"
+                              "movq 56(%1),%%mm7\n\t"
+                              "movq %%mm0,  (%2)\n\t"
+                              "movq %%mm1, 8(%2)\n\t"
+                              "movq %%mm2,16(%2)\n\t"
+                              "movq %%mm3,24(%2)\n\t"
+                              "movq %%mm4,32(%2)\n\t"
+                              "movq %%mm5,40(%2)\n\t"
+                              "movq %%mm6,48(%2)\n\t"
+                              "movq %%mm7,56(%2)\n\t"
+                              "addl $64,%1\n\t"
+                              "addl $64,%2\n\t"
+                              "decl %0\n\t"
+                              "jnz 1b\n\t"
+                              "emms"
+                              : "=&r" (d0), "=&r" (d1), "=&r" (d2)
+                              : "0" (chunk >> 6), "1" (s), "2" (d)
+                              : "memory");
+
+        restore_flags (flags);
+
+        s += chunk;
+        d += chunk;
+        n -= chunk;
+      }
+
+  rep_memcpy (d, s, n);
+
+  return dest;
+}
+
+static void* mmx_memset (void* dest, int c, size_t n)
+{
+  uint8* d = CAST(uint8*,dest);
+  uint32 pattern = CAST(uint8,c) * 0x01010101;
+
+  if (n >= WIDE_MIN)
+    while (n >= 64)
+      {
+        size_t chunk = (n > WIDE_CHUNK) ? WIDE_CHUNK : (n & ~63);
+        uint32 d0, d1;
+        uint32 flags = save_flags_and_disable_interrupts ();
+
+        __asm__ __volatile__ ("movd %4,%%mm0\n\t"
+                              "punpckldq %%mm0,%%mm0\n\t"
+                              "1:\n\t"
+                              "movq %%mm0,  (%1)\n\t"
+                              "movq %%mm0, 8(%1)\n\t"
+                              "movq %%mm0,16(%1)\n\t"
+                              "movq %%mm0,24(%1)\n\t"
+                              "movq %%mm0,32(%1)\n\t"
+                              "movq %%mm0,40(%1)\n\t"
+                              "movq %%mm0,48(%1)\n\t"
+                              "movq %%mm0,56(%1)\n\t"
+                              "addl $64,%1\n\t"
+                              "decl %0\n\t"
+                              "jnz 1b\n\t"
+                              "emms"
+                              : "=&r" (d0), "=&r" (d1)
+                              : "0" (chunk >> 6), "1" (d), "r" (pattern)
+                              : "memory");
+
+        restore_flags (flags);
+
+        d += chunk;
+        n -= chunk;
+      }
+
+  rep_memset (d, c, n);
+
+  return dest;
+}
+
+static void* sse2_memcpy (void* dest, const void* src, size_t n)
+{
+  uint8* d = CAST(uint8*,dest);
+  const uint8* s = CAST(const uint8*,src);
+
+  if (n >= WIDE_MIN)
+    while (n >= 64)
+      {
+        size_t chunk = (n > WIDE_CHUNK) ? WIDE_CHUNK : (n & ~63);
+        uint32 d0, d1, d2;
+        uint32 flags = save_flags_and_disable_interrupts ();
+
+        __asm__ __volatile__ ("1:\n\t"
+                              "movdqu   (%1),%%xmm0\n\t"
+                              "movdqu 16(%1),%%xmm1\n\t"
+                              "movdqu 32(%1),%%xmm2\n\t"
+                              "movdqu 48(%1),%%xmm3\n\t"
+                              "movdqu %%xmm0,  (%2)\n\t"
+                              "movdqu %%xmm1,16(%2)\n\t"
+                              "movdqu %%xmm2,32(%2)\n\t"
+                              "movdqu %%xmm3,48(%2)\n\t"
+                              "addl $64,%1\n\t"
+                              "addl $64,%2\n\t"
+                              "decl %0\n\t"
+                              "jnz 1b"
+                              : "=&r" (d0), "=&r" (d1), "=&r" (d2)
+                              : "0" (chunk >> 6), "1" (s), "2" (d)
+                              : "memory");
+
+        restore_flags (flags);
+
+        s += chunk;
+        d += chunk;
+        n -= chunk;
+      }
+
+  rep_memcpy (d, s, n);
+
+  return dest;
+}
+
+static void* sse2_memset (void* dest, int c, size_t n)
+{
+  uint8* d = CAST(uint8*,dest);
+  uint32 pattern = CAST(uint8,c) * 0x01010101;
+
+  if (n >= WIDE_MIN)
+    while (n >= 64)
+      {
+        size_t chunk = (n > WIDE_CHUNK) ? WIDE_CHUNK : (n & ~63);
+        uint32 d0, d1;
+        uint32 flags = save_flags_and_disable_interrupts ();
+
+        __asm__ __volatile__ ("movd %4,%%xmm0\n\t"
+                              "pshufd $0,%%xmm0,%%xmm0\n\t"
+                              "1:\n\t"
+                              "movdqu %%xmm0,  (%1)\n\t"
+                              "movdqu %%xmm0,16(%1)\n\t"
+                              "movdqu %%xmm0,32(%1)\n\t"
+                              "movdqu %%xmm0,48(%1)\n\t"
+                              "addl $64,%1\n\t"
+                              "decl %0\n\t"
+                              "jnz 1b"
+                              : "=&r" (d0), "=&r" (d1)
+                              : "0" (chunk >> 6), "1" (d), "r" (pattern)
+                              : "memory");
+
+        restore_flags (flags);
+
+        d += chunk;
+        n -= chunk;
+      }
+
+  rep_memset (d, c, n);
+
+  return dest;
+}
+
+static void* (*memcpy_fn) (void*, const void*, size_t) = rep_memcpy;
+static void* (*memset_fn) (void*, int, size_t) = rep_memset;
+
+static void setup_memory_routines ()
+{
+  uint32 dummy, features;
+
+  cpuid (1, dummy, dummy, dummy, features);
+
+  if (features & (HAS_MMX | HAS_SSE2))
+    set_cr0 (cr0_reg () & ~(CR0_EM | CR0_TS)); // allow MMX/SSE instructions
+
+  if ((features & HAS_SSE2) && (features & HAS_FXSR))
+    {
+      set_cr4 (cr4_reg () | CR4_OSFXSR);
+      memcpy_fn = sse2_memcpy;
+      memset_fn = sse2_memset;
+    }
+  else if (features & HAS_MMX)
+    {
+      memcpy_fn = mmx_memcpy;
+      memset_fn = mmx_memset;
+    }
+}
+
 extern "C"
 void* memcpy (void* dest, const void* src, size_t n)
 {
-  uint8* d = CAST(uint8*,dest);
-  uint8* s = CAST(uint8*,src);
-  while (n-- > 0) *d++ = *s++;
+  return memcpy_fn (dest, src, n);
+}
+
+extern "C"
+void* memset (void* dest, int c, size_t n)
+{
+  return memset_fn (dest, c, n);
+}
+
+extern "C"
+void* memmove (void* dest, const void* src, size_t n)
+{
+  // A forward copy is correct unless the destination starts inside
+  // the source, in which case the copy is done backward.
+
+  if (CAST(uint8*,dest) <= CAST(const uint8*,src)
+      || CAST(uint8*,dest) >= CAST(const uint8*,src) + n)
+    return memcpy_fn (dest, src, n);
+
+  uint32 d0, d1, d2;
+
+  // Interrupts are disabled while the direction flag is set, so that
+  // no IRQ handler or preempting thread runs with DF=1.
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  __asm__ __volatile__ ("std\n\t"
+                        "rep; movsb\n\t"
+                        "subl $3,%%esi\n\t"
+                        "subl $3,%%edi\n\t"
+                        "movl %6,%%ecx\n\t"
+                        "rep; movsl\n\t"
+                        "cld"
+                        : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+                        : "0" (n & 3),
+                          "1" (CAST(uint8*,dest) + n - 1),
+                          "2" (CAST(const uint8*,src) + n - 1),
+                          "g" (n >> 2)
+                        : "memory");
+
+  restore_flags (flags);
+
   return dest;
 }
 
@@ -188,7 +788,12 @@ void __do_global_ctors ()
 
 void __do_global_dtors ()
 {
-  // Not implemented yet.
+  for (unsigned int i = 1; __DTOR_LIST__[i] != 0; i++)
+    __DTOR_LIST__[i] ();
+
+#ifdef INSTRUMENT_HEAP
+  heap_report ();
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -201,16 +806,16 @@ static void setup_bss ()
 {
   extern uint8 edata[], end[];
 
-  uint8* p = edata;
-
-  while (p < end) // zero out BSS
-    *p++ = 0;
+  memset (edata, 0, end - edata); // zero out BSS
 }
 
 extern "C"
 void __rtlib_entry ()
 {
   setup_bss ();
+  setup_memory_routines ();
+  setup_pages ();
+  setup_paging ();
   setup_intr ();
   setup_time ();
 
@@ -223,6 +828,8 @@ void __rtlib_entry ()
 
 //-----------------------------------------------------------------------------
 
+uint32 _cpu_features;
+
 static void identify_cpu ()
 {
   uint32 max_fn;
@@ -239,6 +846,8 @@ static void identify_cpu ()
 
   cpuid (1, processor, dummy, dummy, features);
 
+  _cpu_features = features;
+
 #ifdef SHOW_CPU_INFO
 
   cout << "CPU is " << vendor
@@ -305,10 +914,31 @@ static void __rtlib_setup ()
 
   identify_cpu ();
 
+  cout << "RAM = " << _ram_kb << " KB, usable = "
+       << _usable_pages * (PAGE_SIZE >> 10) << " KB\n";
+
+#ifdef SHOW_MEM_INFO
+  report_pages ();
+#endif
+
+#ifdef SHOW_VIDEO_BENCHMARK
+  video::screen.benchmark_fill_rect ();
+#endif
+
+  video::screen.enable_write_combining ();
+
+#ifdef SHOW_VIDEO_BENCHMARK
+  video::screen.benchmark_fill_rect ();
+#endif
+
   setup_ps2 ();
 
   enable_interrupts ();
 
+#ifdef SHOW_CONTEXT_SWITCH_BENCHMARK
+  scheduler::benchmark_context_switch ();
+#endif
+
   main ();
 
   __do_global_dtors ();
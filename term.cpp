@@ -9,6 +9,7 @@
 //-----------------------------------------------------------------------------
 
 #include "term.h"
+#include "arena.h"
 
 //-----------------------------------------------------------------------------
 
@@ -645,15 +646,26 @@ term& operator<< (term& t, void* x)
 
 term& operator<< (term& t, native_string x)
 {
-  unicode_char buf[2];
+  // The string is converted in a scratch buffer and written all at
+  // once.  Short strings are converted in a buffer on the stack.
 
-  buf[1] = '\0';
+  unicode_char local[64];
+  arena scratch (local, sizeof (local));
+  int n = 0;
 
-  while (*x != '\0')
-    {
-      buf[0] = CAST(uint8,*x++);
-      t << buf;
-    }
+  while (x[n] != '\0')
+    n++;
+
+  unicode_char* buf =
+    CAST(unicode_char*,scratch.alloc (n * sizeof (unicode_char)));
+
+  if (buf == NULL)
+    return t;
+
+  for (int i = 0; i < n; i++)
+    buf[i] = CAST(uint8,x[i]);
+
+  t.write (buf, n);
 
   return t;
 }
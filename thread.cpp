@@ -16,117 +16,148 @@
 #include "intr.h"
 #include "time.h"
 #include "rtlib.h"
+#include "page.h"
+#include "pool.h"
 #include "term.h"
 
 //-----------------------------------------------------------------------------
 
 // "mutex" class implementation.
 
+static object_pool<mutex, 32, TRUE> mutex_pool;
+
 mutex::mutex ()
 {
-  wait_queue_init (this);
+  prio_wait_queue_ops::init (this);
   _locked = FALSE;
 }
 
+void* mutex::operator new (size_t size)
+{
+  void* obj = mutex_pool.allocate (size);
+  return (obj != NULL) ? obj : ::operator new (size);
+}
+
+void mutex::operator delete (void* obj)
+{
+  if (!mutex_pool.release (obj))
+    ::operator delete (obj);
+}
+
 void mutex::lock ()
 {
-  disable_interrupts ();
+  preempt_disable ();
 
   if (_locked)
-    save_context (&scheduler::suspend_on_wait_queue, this);
+    context_switch (&scheduler::suspend_on_wait_queue, this);
   else
     _locked = TRUE;
 
-  enable_interrupts ();
+  preempt_enable ();
 }
 
 bool mutex::lock_or_timeout (time timeout)
 {
-  disable_interrupts ();
+  preempt_disable ();
 
   thread* current = scheduler::current_thread;
 
   if (_locked)
     {
-      if (!less_time (current_time_no_interlock (), timeout))
+      if (!less_time (current_time (), timeout))
         {
-          enable_interrupts ();
+          preempt_enable ();
           return FALSE;
         }
 
       current->_timeout = timeout;
+      current->_slack = nanoseconds_to_time (0);
       current->_did_not_timeout = TRUE;
 
-      wait_queue_remove (current);
-      wait_queue_insert (current, this);
-      save_context (&scheduler::suspend_on_sleep_queue, NULL);
+      wait_queue_ops::remove (current);
+      prio_wait_queue_ops::insert (current, this);
+      context_switch (&scheduler::suspend_on_sleep_queue, NULL);
 
       bool did_not_timeout = current->_did_not_timeout;
 
-      enable_interrupts ();
+      preempt_enable ();
 
       return did_not_timeout;
     }
 
   _locked = TRUE;
 
-  enable_interrupts ();
+  preempt_enable ();
 
   return TRUE;
 }
 
 void mutex::unlock ()
 {
-  disable_interrupts ();
+  preempt_disable ();
 
-  thread* t = wait_queue_head (CAST(wait_queue*,this));
+  thread* t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,this));
 
   if (t == NULL)
     _locked = FALSE;
   else
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 
-  enable_interrupts ();
+  preempt_enable ();
 }
 
 //-----------------------------------------------------------------------------
 
 // "condvar" class implementation.
 
+static object_pool<condvar, 32, TRUE> condvar_pool;
+
 condvar::condvar ()
 {
-  wait_queue_init (this);
+  prio_wait_queue_ops::init (this);
+}
+
+void* condvar::operator new (size_t size)
+{
+  void* obj = condvar_pool.allocate (size);
+  return (obj != NULL) ? obj : ::operator new (size);
+}
+
+void condvar::operator delete (void* obj)
+{
+  if (!condvar_pool.release (obj))
+    ::operator delete (obj);
 }
 
 void condvar::wait (mutex* m)
 {
 #ifdef SOLUTION
 
-  disable_interrupts ();
+  preempt_disable ();
 
-  thread* t = wait_queue_head (CAST(wait_queue*,m));
+  thread* t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,m));
 
   if (t == NULL)
     m->_locked = FALSE;
   else
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 
-  save_context (&scheduler::suspend_on_wait_queue, this);
+  context_switch (&scheduler::suspend_on_wait_queue, this);
 
   if (m->_locked)
-    save_context (&scheduler::suspend_on_wait_queue, m);
+    context_switch (&scheduler::suspend_on_wait_queue, m);
   else
     m->_locked = TRUE;
 
-  enable_interrupts ();
+  preempt_enable ();
 
 #else
 
@@ -142,41 +173,42 @@ bool condvar::wait_or_timeout (mutex* m, time timeout)
 {
 #ifdef SOLUTION
 
-  disable_interrupts ();
+  preempt_disable ();
 
   thread* current = scheduler::current_thread;
 
-  thread* t = wait_queue_head (CAST(wait_queue*,m));
+  thread* t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,m));
 
   if (t == NULL)
     m->_locked = FALSE;
   else
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 
-  if (!less_time (current_time_no_interlock (), timeout))
+  if (!less_time (current_time (), timeout))
     {
-      enable_interrupts ();
+      preempt_enable ();
       return FALSE;
     }
 
   current->_timeout = timeout;
+  current->_slack = nanoseconds_to_time (0);
   current->_did_not_timeout = TRUE;
 
-  wait_queue_remove (current);
-  wait_queue_insert (current, this);
-  save_context (&scheduler::suspend_on_sleep_queue, NULL);
+  wait_queue_ops::remove (current);
+  prio_wait_queue_ops::insert (current, this);
+  context_switch (&scheduler::suspend_on_sleep_queue, NULL);
 
   if (current->_did_not_timeout)
     {
-      enable_interrupts ();
+      preempt_enable ();
       return m->lock_or_timeout (timeout);
     }
 
-  enable_interrupts ();
+  preempt_enable ();
 
   return FALSE;
 
@@ -193,55 +225,56 @@ bool condvar::wait_or_timeout (mutex* m, time timeout)
 
 void condvar::signal ()
 {
-  disable_interrupts ();
+  preempt_disable ();
 
-  thread* t = wait_queue_head (CAST(wait_queue*,this));
+  thread* t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,this));
 
   if (t != NULL)
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 
-  enable_interrupts ();
+  preempt_enable ();
 }
 
 void condvar::broadcast ()
 {
-  disable_interrupts ();
+  preempt_disable ();
 
   thread* t;
 
-  while ((t = wait_queue_head (CAST(wait_queue*,this))) != NULL)
+  while ((t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,this)))
+         != NULL)
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 
-  enable_interrupts ();
+  preempt_enable ();
 }
 
 void condvar::mutexless_wait ()
 {
-  ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
+  ASSERT_PREEMPT_DISABLED (); // Preemption should be disabled at this point
 
-  save_context (&scheduler::suspend_on_wait_queue, this);
+  context_switch (&scheduler::suspend_on_wait_queue, this);
 
-  ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
+  ASSERT_PREEMPT_DISABLED (); // Preemption should be disabled at this point
 }
 
 void condvar::mutexless_signal ()
 {
-  ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
+  ASSERT_PREEMPT_DISABLED (); // Preemption should be disabled at this point
 
-  thread* t = wait_queue_head (CAST(wait_queue*,this));
+  thread* t = prio_wait_queue_ops::head (CAST(prio_wait_queue*,this));
 
   if (t != NULL)
     {
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       scheduler::reschedule_thread (t);
     }
 }
@@ -250,51 +283,141 @@ void condvar::mutexless_signal ()
 
 // "thread" class implementation.
 
-thread::thread ()
+// Thread stacks are allocated directly from the page allocator so that
+// they do not fragment the small object heap.  The page below each
+// stack is a guard page which is made not present, so that a stack
+// overflow causes a fault instead of corrupting the neighboring memory.
+
+// The usable part of a thread's stack starts on the page following
+// the guard page.  It is filled with "STACK_CANARY" so that the stack
+// usage can be measured later.  Interrupt handlers run on the IRQ
+// stack, so the measured usage does not include interrupt nesting.
+
+#define STACK_CANARY 0xa5a5a5a5
+#define STACK_CANARY_WORDS 16 // words checked by "stack_overflowed"
+
+thread* thread::all_threads;
+
+thread::thread (uint32 stack_size)
 {
-  static const int stack_size = 65536; // size of thread stacks in bytes
+  wait_queue_ops::detach (this);
+  mutex_queue_ops::init (this);
+  sleep_queue_ops::detach (this);
 
-  mutex_queue_init (this);
-  sleep_queue_detach (this);
+  _stack_pages = (stack_size + PAGE_SIZE - 1) / PAGE_SIZE + 1; // with guard
 
-  uint32* s = CAST(uint32*,kmalloc (stack_size));
+  uint32* s = CAST(uint32*,alloc_pages (_stack_pages));
 
   if (s == NULL)
     fatal_error ("out of memory");
 
+  set_page_present (s, FALSE); // guard page
+
   _stack = s;
 
-  s += stack_size / sizeof (uint32);
+  memset (s + PAGE_SIZE / sizeof (uint32),
+          STACK_CANARY & 0xff,
+          (_stack_pages - 1) * PAGE_SIZE);
+
+  s += _stack_pages * PAGE_SIZE / sizeof (uint32);
 
   *--s = 0;              // the (dummy) return address of "run_thread"
-  *--s = eflags_reg ();  // space for "EFLAGS"
-  *--s = cs_reg ();      // space for "%cs"
   *--s = CAST(uint32,&scheduler::run_thread); // to call "run_thread"
 
-  // Note: the 3 topmost words on the thread's stack are in the same
-  // layout as expected by the "iret" instruction.  When an "iret"
-  // instruction is executed to restore the thread's context, the
-  // function "run_thread" will be called and this function will get a
-  // dummy return address (it is important that the function
-  // "run_thread" never returns).
+  // Note: when the "ret" instruction of "restore_context" is executed
+  // to restore the thread's context, the function "run_thread" will
+  // be called and this function will get a dummy return address (it
+  // is important that the function "run_thread" never returns).
 
   _sp = s;
 
   _quantum = frequency_to_time (10000); // quantum is 1/10000th of a second
 
+  _prio = normal_priority;
+
   _terminated = FALSE;
+
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  _prev_thread = NULL;
+  _next_thread = all_threads;
+  if (all_threads != NULL)
+    all_threads->_prev_thread = this;
+  all_threads = this;
+
+  restore_flags (flags);
 }
 
 thread::~thread ()
 {
-  kfree (_stack);
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  if (_prev_thread == NULL)
+    all_threads = _next_thread;
+  else
+    _prev_thread->_next_thread = _next_thread;
+  if (_next_thread != NULL)
+    _next_thread->_prev_thread = _prev_thread;
+
+  restore_flags (flags);
+
+  set_page_present (_stack, TRUE);
+  free_pages (_stack, _stack_pages);
+}
+
+uint32 thread::stack_size ()
+{
+  return (_stack_pages - 1) * PAGE_SIZE;
+}
+
+uint32 thread::stack_high_water ()
+{
+  uint32* bottom = _stack + PAGE_SIZE / sizeof (uint32);
+  uint32* top = _stack + _stack_pages * PAGE_SIZE / sizeof (uint32);
+  uint32* p = bottom;
+
+  while (p < top && *p == STACK_CANARY)
+    p++;
+
+  return CAST(uint8*,top) - CAST(uint8*,p);
+}
+
+bool thread::stack_overflowed ()
+{
+  uint32* bottom = _stack + PAGE_SIZE / sizeof (uint32);
+
+  for (int i = 0; i < STACK_CANARY_WORDS; i++)
+    if (bottom[i] != STACK_CANARY)
+      return TRUE;
+
+  return FALSE;
+}
+
+void thread::report_stacks ()
+{
+  uint32 flags = save_flags_and_disable_interrupts ();
+
+  cout << "thread stacks (bytes used / size):\n";
+
+  for (thread* t = all_threads; t != NULL; t = t->_next_thread)
+    {
+      cout << "  " << CAST(void*,t) << ": "
+           << t->stack_high_water () << " / " << t->stack_size ();
+      if (t->stack_overflowed ())
+        cout << " OVERFLOW";
+      if (t == scheduler::current_thread)
+        cout << " (current)";
+      cout << "\n";
+    }
+
+  restore_flags (flags);
 }
 
 thread* thread::start ()
 {
-  disable_interrupts ();
+  preempt_disable ();
   scheduler::reschedule_thread (this);
-  enable_interrupts ();
+  preempt_enable ();
   return this;
 }
 
@@ -308,9 +431,9 @@ void thread::join ()
 
 void thread::yield ()
 {
-  disable_interrupts ();
-  save_context (&scheduler::switch_to_next_thread, NULL);
-  enable_interrupts ();
+  preempt_disable ();
+  context_switch (&scheduler::switch_to_next_thread, NULL);
+  preempt_enable ();
 }
 
 thread* thread::self ()
@@ -318,6 +441,54 @@ thread* thread::self ()
   return scheduler::current_thread;
 }
 
+priority thread::get_priority ()
+{
+  return _prio;
+}
+
+void thread::set_priority (priority p)
+{
+  _prio = p;
+}
+
+void thread::sleep_until (time t)
+{
+  sleep_until (t, nanoseconds_to_time (0));
+}
+
+void thread::sleep_until (time t, time slack)
+{
+  preempt_disable ();
+
+  thread* current = scheduler::current_thread;
+
+  if (less_time (current_time (), t))
+    {
+      current->_timeout = t;
+      current->_slack = slack;
+      current->_did_not_timeout = TRUE;
+
+      // The thread is on no wait queue while it sleeps, so only the
+      // timer can make it runnable again.
+
+      wait_queue_ops::remove (current);
+      wait_queue_ops::detach (current);
+      context_switch (&scheduler::suspend_on_sleep_queue, NULL);
+    }
+
+  preempt_enable ();
+}
+
+void thread::sleep_for (time duration)
+{
+  sleep_until (add_time (current_time (), duration));
+}
+
+void thread::sleep_for (time duration, time slack)
+{
+  sleep_until (add_time (current_time (), duration), slack);
+}
+
 //-----------------------------------------------------------------------------
 
 // "primordial_thread" class.
@@ -348,23 +519,38 @@ void primordial_thread::run ()
 
 // "scheduler" class implementation.
 
+// When CHECK_STACK_CANARY is defined, the stack of a thread is
+// checked for overflow each time the thread gives up the processor.
+
+#ifdef CHECK_STACK_CANARY
+#define CHECK_STACK(t) \
+  do { if ((t)->stack_overflowed ()) fatal_error ("thread stack overflow"); } \
+  while (0)
+#else
+#define CHECK_STACK(t)
+#endif
+
 void scheduler::setup (void_fn continuation)
 {
   ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
 
   readyq = new wait_queue;
-  wait_queue_init (readyq);
+  wait_queue_ops::init (readyq);
 
   sleepq = new sleep_queue;
-  sleep_queue_init (sleepq);
+  sleep_queue_ops::init (sleepq);
 
   the_primordial_thread = new primordial_thread (continuation);
   current_thread = the_primordial_thread;
 
-  wait_queue_insert (current_thread, readyq);
+  coalesced_wakeups = 0;
+
+  wait_queue_ops::insert (current_thread, readyq);
 
   setup_timer ();
 
+  preempt_count = 1; // the count when a thread is resumed
+
   scheduler::resume_next_thread ();
 
   // ** NEVER REACHED ** (this function never returns)
@@ -372,20 +558,26 @@ void scheduler::setup (void_fn continuation)
 
 void scheduler::reschedule_thread (thread* t)
 {
-  ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
+  ASSERT_PREEMPT_DISABLED (); // Preemption should be disabled at this point
 
-  wait_queue_remove (t);
-  wait_queue_insert (t, readyq);
+  wait_queue_ops::remove (t);
+  wait_queue_ops::insert (t, readyq);
 }
 
 void scheduler::run_thread ()
 {
+  // The thread was resumed with interrupts and preemption disabled.
+
+  enable_interrupts ();
+  preempt_enable ();
+
   current_thread->run ();
   current_thread->_terminated = TRUE;
   current_thread->_joiners.broadcast ();
 
+  preempt_disable ();
   disable_interrupts ();
-  wait_queue_remove (current_thread);
+  wait_queue_ops::remove (current_thread);
   resume_next_thread ();
 
   // ** NEVER REACHED ** (this function never returns)
@@ -395,14 +587,14 @@ void scheduler::resume_next_thread ()
 {
   ASSERT_INTERRUPTS_DISABLED (); // Interrupts should be disabled at this point
 
-  thread* current = wait_queue_head (readyq);
+  thread* current = wait_queue_ops::head (readyq);
 
   if (current != NULL)
     {
       current_thread = current;
       time now = current_time_no_interlock ();
       current->_end_of_quantum = add_time (now, current->_quantum);
-      set_timer (current->_end_of_quantum, now);
+      arm_timer (now);
       restore_context (current->_sp);
 
       // ** NEVER REACHED **
@@ -414,8 +606,8 @@ void scheduler::resume_next_thread ()
 }
 
 void scheduler::switch_to_next_thread
-  (uint32 cs,     // The parameters "cs" and "eflags" are only on
-   uint32 eflags, // the stack as a byproduct of using "iret".
+  (uint32 cs,     // The parameters "cs" and "eflags" are unused
+   uint32 eflags, // (see "save_context").
    uint32* sp,
    void* dummy)
 {
@@ -424,6 +616,7 @@ void scheduler::switch_to_next_thread
   thread* current = current_thread;
 
   current->_sp = sp;
+  CHECK_STACK (current);
   reschedule_thread (current);
   resume_next_thread ();
 
@@ -431,8 +624,8 @@ void scheduler::switch_to_next_thread
 }
 
 void scheduler::suspend_on_wait_queue
-  (uint32 cs,     // The parameters "cs" and "eflags" are only on
-   uint32 eflags, // the stack as a byproduct of using "iret".
+  (uint32 cs,     // The parameters "cs" and "eflags" are unused
+   uint32 eflags, // (see "save_context").
    uint32* sp,
    void* q)
 {
@@ -441,16 +634,17 @@ void scheduler::suspend_on_wait_queue
   thread* current = current_thread;
 
   current->_sp = sp;
-  wait_queue_remove (current);
-  wait_queue_insert (current, CAST(wait_queue*,q));
+  CHECK_STACK (current);
+  wait_queue_ops::remove (current);
+  prio_wait_queue_ops::insert (current, CAST(prio_wait_queue*,q));
   resume_next_thread ();
 
   // ** NEVER REACHED ** (this function never returns)
 }
 
 void scheduler::suspend_on_sleep_queue
-  (uint32 cs,     // The parameters "cs" and "eflags" are only on
-   uint32 eflags, // the stack as a byproduct of using "iret".
+  (uint32 cs,     // The parameters "cs" and "eflags" are unused
+   uint32 eflags, // (see "save_context").
    uint32* sp,
    void* dummy)
 {
@@ -459,7 +653,8 @@ void scheduler::suspend_on_sleep_queue
   thread* current = current_thread;
 
   current->_sp = sp;
-  sleep_queue_insert (current, sleepq);
+  CHECK_STACK (current);
+  sleep_queue_ops::insert (current, sleepq);
   resume_next_thread ();
 
   // ** NEVER REACHED ** (this function never returns)
@@ -488,6 +683,7 @@ void scheduler::setup_timer ()
   outb (PIT_CW_CTR(0) | PIT_COUNT_FORMAT | PIT_CW_MODE(0),
         PIT_PORT_CW(PIT1_PORT_BASE));
 
+  register_irq_handler (0, PIT_timer_irq, NULL);
   ENABLE_IRQ(0);
 
 #endif
@@ -507,7 +703,7 @@ void scheduler::set_timer (time t, time now)
 {
   // t must be >= now
 
-  ASSERT_INTERRUPTS_DISABLED ();
+  ASSERT_PREEMPT_DISABLED ();
 
   int64 count;
 
@@ -553,36 +749,137 @@ void scheduler::set_timer (time t, time now)
 #endif
 }
 
+void scheduler::arm_timer (time now)
+{
+  ASSERT_PREEMPT_DISABLED ();
+
+  // The timer must expire at the end of the current thread's quantum
+  // or at the latest acceptable wakeup time of a sleeping thread,
+  // whichever comes first.  Since the sleep queue is sorted by
+  // "_timeout" and the latest wakeup time of a thread is never
+  // before its "_timeout", the scan can stop at the first thread
+  // whose "_timeout" is not before the expiry found so far.
+
+  time expiry = current_thread->_end_of_quantum;
+  wait_mutex_sleep_node* node = sleepq->_next_in_sleep_queue;
+
+  while (node != sleepq)
+    {
+      thread* t = CAST(thread*,node);
+
+      if (!less_time (t->_timeout, expiry))
+        break;
+
+      time latest = add_time (t->_timeout, t->_slack);
+
+      if (less_time (latest, expiry))
+        expiry = latest;
+
+      node = node->_next_in_sleep_queue;
+    }
+
+  if (less_time (expiry, now))
+    expiry = now;
+
+  timer_expiry = expiry;
+
+  set_timer (expiry, now);
+}
+
 void scheduler::timer_elapsed ()
 {
   ASSERT_INTERRUPTS_DISABLED ();
 
-  time now = current_time_no_interlock ();
+  // The sleeping threads are woken up after the IRQ, so that
+  // interrupts are only disabled for a short time.
+
+  defer_work (&timer_work);
+}
+
+void scheduler::timer_bottom_half (void* arg)
+{
+  // Deferred work runs with preemption disabled, so the queues can
+  // be updated with interrupts enabled.
+
+  ASSERT_PREEMPT_DISABLED ();
+
+  time now;
+  uint32 woken = 0;
 
   for (;;)
     {
-      thread* t = sleep_queue_head (sleepq);
+      now = current_time ();
+
+      thread* t = sleep_queue_ops::head (sleepq);
 
       if (t == NULL || less_time (now, t->_timeout))
         break;
 
       t->_did_not_timeout = FALSE;
-      sleep_queue_remove (t);
-      sleep_queue_detach (t);
+      sleep_queue_ops::remove (t);
+      sleep_queue_ops::detach (t);
       reschedule_thread (t);
+      woken++;
     }
 
   thread* current = current_thread;
 
+  // Every thread woken up by this interrupt would have needed an
+  // interrupt of its own without slack, except the one (if any) for
+  // which the timer was set.
+
+  if (woken > 0)
+    {
+      if (!equal_time (timer_expiry, current->_end_of_quantum))
+        woken--;
+      coalesced_wakeups += woken;
+    }
+
   if (less_time (now, current->_end_of_quantum))
-    set_timer (current->_end_of_quantum, now);
+    arm_timer (now);
   else
-    save_context (&switch_to_next_thread, NULL);
+    need_resched = TRUE;
+}
+
+void scheduler::preempt_if_needed ()
+{
+  ASSERT_INTERRUPTS_DISABLED ();
+  ASSERT_PREEMPT_COUNT (0); // the count is set to 1 for the switch
+
+  if (need_resched)
+    {
+      need_resched = FALSE;
+      preempt_count = 1;
+      save_context (&switch_to_next_thread, NULL);
+      preempt_count = 0;
+    }
+}
+
+void scheduler::preempt (uint32* sp)
+{
+  ASSERT_INTERRUPTS_DISABLED ();
+  ASSERT_PREEMPT_COUNT (0); // the count is set to 1 for the switch
+
+  need_resched = FALSE;
+  preempt_count = 1; // reset by "irq_resume_thread"
+  switch_to_next_thread (0, 0, sp, NULL);
+
+  // ** NEVER REACHED ** (this function never returns)
+}
+
+bool scheduler::resched_needed ()
+{
+  return need_resched;
+}
+
+uint32 scheduler::timer_interrupts_saved ()
+{
+  return coalesced_wakeups;
 }
 
 #ifdef USE_PIT_FOR_TIMER
 
-void irq0 ()
+void PIT_timer_irq (void* arg)
 {
   ASSERT_INTERRUPTS_DISABLED ();
 
@@ -590,8 +887,6 @@ void irq0 ()
   cout << "\033[41m irq0 \033[0m";
 #endif
 
-  ACKNOWLEDGE_IRQ(0);
-
   scheduler::timer_elapsed ();
 }
 
@@ -599,7 +894,7 @@ void irq0 ()
 
 #ifdef USE_APIC_FOR_TIMER
 
-void APIC_timer_irq ()
+bool APIC_timer_irq ()
 {
   ASSERT_INTERRUPTS_DISABLED ();
 
@@ -607,9 +902,128 @@ void APIC_timer_irq ()
   cout << "\033[41m APIC timer irq \033[0m";
 #endif
 
+#ifdef PROFILE_INTERRUPTS_DISABLED
+  intr_off_begin ("APIC timer irq", 0);
+#endif
+
   APIC_EOI = 0;
 
   scheduler::timer_elapsed ();
+
+  bool preempt = run_deferred_work ();
+
+#ifdef PROFILE_INTERRUPTS_DISABLED
+  // Ended by the resumed thread when this one is preempted (see
+  // "irq_dispatch").
+  if (!preempt)
+    intr_off_end ();
+#endif
+
+  return preempt;
+}
+
+#endif
+
+#ifdef SHOW_CONTEXT_SWITCH_BENCHMARK
+
+// The context switch benchmark uses two threads which take turns,
+// either by yielding or by blocking on a condition variable, and
+// reports the number of cycles per switch.  It is run before any
+// other thread is started.
+
+#define NB_BENCHMARK_SWITCHES 10000
+
+static condvar* benchmark_cv;
+static volatile int benchmark_turn;
+
+static void benchmark_block (int me)
+{
+  preempt_disable ();
+
+  while (benchmark_turn != me)
+    benchmark_cv->mutexless_wait ();
+
+  benchmark_turn = 1 - me;
+
+  benchmark_cv->mutexless_signal ();
+
+  preempt_enable ();
+}
+
+class benchmark_thread : public thread
+  {
+  public:
+
+    benchmark_thread (void_fn yield_fn); // NULL to block instead
+
+    void take_turns ();
+
+  protected:
+
+    void run ();
+
+    void_fn _yield_fn;
+  };
+
+benchmark_thread::benchmark_thread (void_fn yield_fn)
+{
+  _yield_fn = yield_fn;
+}
+
+void benchmark_thread::take_turns ()
+{
+  int me = (thread::self () == this);
+
+  for (int i=0; i<NB_BENCHMARK_SWITCHES; i++)
+    if (_yield_fn == NULL)
+      benchmark_block (me);
+    else
+      _yield_fn ();
+}
+
+void benchmark_thread::run ()
+{
+  take_turns ();
+}
+
+static uint32 benchmark_cycles_per_switch (void_fn yield_fn)
+{
+  // The thread is not deleted because it may still be running on its
+  // stack when "join" returns.
+
+  benchmark_thread* t = new benchmark_thread (yield_fn);
+
+  benchmark_turn = 0;
+
+  uint64 start = rdtsc ();
+
+  t->start ();
+  t->take_turns ();
+  t->join ();
+
+  return CAST(uint32,(rdtsc () - start) / (2*NB_BENCHMARK_SWITCHES));
+}
+
+void scheduler::yield_with_full_save ()
+{
+  preempt_disable ();
+  disable_interrupts ();
+  save_context (&switch_to_next_thread, NULL);
+  enable_interrupts ();
+  preempt_enable ();
+}
+
+void scheduler::benchmark_context_switch ()
+{
+  benchmark_cv = new condvar;
+
+  uint32 yield_cycles = benchmark_cycles_per_switch (&thread::yield);
+  uint32 full_cycles = benchmark_cycles_per_switch (&yield_with_full_save);
+  uint32 block_cycles = benchmark_cycles_per_switch (NULL);
+
+  cout << "context switch: yield " << yield_cycles
+       << " cycles (" << full_cycles << " cycles with save_context), block "
+       << block_cycles << " cycles\n";
 }
 
 #endif
@@ -618,6 +1032,13 @@ wait_queue* scheduler::readyq;
 sleep_queue* scheduler::sleepq;
 thread* scheduler::the_primordial_thread;
 thread* scheduler::current_thread;
+time scheduler::timer_expiry;
+uint32 scheduler::coalesced_wakeups;
+deferred_work scheduler::timer_work =
+  DEFERRED_WORK(&scheduler::timer_bottom_half, NULL);
+bool scheduler::need_resched;
+
+volatile uint32 preempt_count;
 
 //-----------------------------------------------------------------------------
 
@@ -118,17 +118,36 @@ static rational rational_rationalize (rational x, rational y)
 
 //-----------------------------------------------------------------------------
 
+// The clock state that is shared between writers and the interrupt
+// free readers of "monotonic_ns" and "realtime" is protected by a
+// sequence lock.  A writer (which runs with interrupts disabled)
+// increments "clock_seq" before and after the update, so that it is
+// odd while the update is in progress.  A reader retries when it sees
+// an odd sequence number or when the sequence number changed while it
+// was reading.
+
+static volatile uint32 clock_seq = 0;
+static volatile uint64 realtime_at_refpoint = 0; // ns since epoch
+
+#define clock_write_begin() \
+do { clock_seq++; compiler_barrier (); } while (0)
+
+#define clock_write_end() \
+do { compiler_barrier (); clock_seq++; } while (0)
+
+//-----------------------------------------------------------------------------
+
 #ifdef USE_IRQ8_FOR_TIME
 
 volatile uint64 _irq8_counter = 0;
 time pos_infinity = { 18446744073709551615ULL };
 time neg_infinity = { 0 };
 
-void irq8 ()
+static void RTC_irq (void* arg)
 {
-  ACKNOWLEDGE_IRQ(8);
-
+  clock_write_begin ();
   _irq8_counter++;
+  clock_write_end ();
 
   outb (RTC_REGC, RTC_PORT_ADDR); // must also read register C to
   inb (RTC_PORT_DATA);            // acknowledge RTC interrupt
@@ -147,8 +166,152 @@ time neg_infinity = { 0 };
 rational _cpu_bus_multiplier;
 #endif
 
+// TSC counts are converted to nanoseconds with a multiplication and a
+// shift ("ns = (counts * tsc_to_ns_mult) >> tsc_to_ns_shift") so that
+// no division is needed when the clocks are read.
+
+static uint32 tsc_to_ns_mult;
+static int tsc_to_ns_shift;
+
 #endif
 
+//-----------------------------------------------------------------------------
+
+// Decoding of the date and time kept by the RTC.
+
+static uint8 rtc_read (uint8 reg)
+{
+  outb (reg, RTC_PORT_ADDR);
+  return inb (RTC_PORT_DATA);
+}
+
+static uint32 rtc_decode (uint8 val, uint8 regb)
+{
+  if ((regb & RTC_REGB_DM) == RTC_REGB_DM_BCD)
+    return (val >> 4) * 10 + (val & 0xf);
+  return val;
+}
+
+static uint32 days_since_epoch (uint32 year, uint32 month, uint32 day)
+{
+  // Days from 1 Jan 1970 to the given date of the proleptic
+  // Gregorian calendar (years are counted from March 1st so that the
+  // leap day is the last day of the year).
+
+  if (month <= 2)
+    {
+      year--;
+      month += 9;
+    }
+  else
+    month -= 3;
+
+  uint32 era = year / 400;
+  uint32 year_of_era = year - era * 400;
+  uint32 day_of_year = (153 * month + 2) / 5 + day - 1;
+  uint32 day_of_era = year_of_era * 365 + year_of_era / 4
+                      - year_of_era / 100 + day_of_year;
+
+  return era * 146097 + day_of_era - 719468;
+}
+
+static uint64 rtc_seconds_since_epoch ()
+{
+  // Must be called right after the update of the seconds register so
+  // that all the registers are read before the next update.
+
+  uint8 regb = rtc_read (RTC_REGB);
+  uint32 sec = rtc_decode (rtc_read (RTC_SEC), regb);
+  uint32 min = rtc_decode (rtc_read (RTC_MIN), regb);
+  uint8 raw_hour = rtc_read (RTC_HOUR);
+  uint32 day = rtc_decode (rtc_read (RTC_DAY_IN_MONTH), regb);
+  uint32 month = rtc_decode (rtc_read (RTC_MONTH), regb);
+  uint32 year = rtc_decode (rtc_read (RTC_YEAR), regb);
+  uint32 hour;
+
+  if ((regb & RTC_REGB_2412) == RTC_REGB_12)
+    {
+      hour = rtc_decode (raw_hour & 0x7f, regb) % 12;
+      if (raw_hour & 0x80) // PM
+        hour += 12;
+    }
+  else
+    hour = rtc_decode (raw_hour, regb);
+
+  year += (year < 70) ? 2000 : 1900;
+
+  return ((CAST(uint64,days_since_epoch (year, month, day)) * 24 + hour) * 60
+          + min) * 60 + sec;
+}
+
+//-----------------------------------------------------------------------------
+
+uint64 monotonic_ns ()
+{
+#ifdef USE_IRQ8_FOR_TIME
+
+  uint32 seq;
+  uint64 counts;
+
+  do
+    {
+      seq = clock_seq;
+      compiler_barrier ();
+      counts = _irq8_counter;
+      compiler_barrier ();
+    } while ((seq & 1) != 0 || seq != clock_seq);
+
+  return counts * (1000000000 / IRQ8_COUNTS_PER_SEC);
+
+#endif
+
+#ifdef USE_TSC_FOR_TIME
+
+  // The conversion state is constant after "setup_time", so no
+  // locking is needed.  The multiplication is split in two to avoid
+  // overflowing 64 bits.
+
+  uint64 counts = rdtsc () - tsc_at_refpoint;
+  uint32 lo = counts;
+  uint32 hi = counts >> 32;
+
+  return ((CAST(uint64,lo) * tsc_to_ns_mult) >> tsc_to_ns_shift)
+         + ((CAST(uint64,hi) * tsc_to_ns_mult) << (32 - tsc_to_ns_shift));
+
+#endif
+}
+
+uint64 realtime ()
+{
+  uint32 seq;
+  uint64 base;
+
+  do
+    {
+      seq = clock_seq;
+      compiler_barrier ();
+      base = realtime_at_refpoint;
+      compiler_barrier ();
+    } while ((seq & 1) != 0 || seq != clock_seq);
+
+  return base + monotonic_ns ();
+}
+
+void set_realtime (uint64 ns)
+{
+  disable_interrupts ();
+
+  uint64 base = ns - monotonic_ns ();
+
+  clock_write_begin ();
+  realtime_at_refpoint = base;
+  clock_write_end ();
+
+  enable_interrupts ();
+}
+
+//-----------------------------------------------------------------------------
+
 void setup_time ()
 {
   // It is assumed that interrupts are currently disabled.  They might
@@ -248,6 +411,19 @@ void setup_time ()
 #ifdef USE_TSC_FOR_TIME
                   tsc_at_refpoint = new_tsc;
                   _tsc_counts_per_sec = new_tsc - old_tsc;
+
+                  // Choose the largest shift for which the multiplier
+                  // still fits in 32 bits.
+
+                  tsc_to_ns_shift = 32;
+                  while (tsc_to_ns_shift > 0
+                         && (CAST(uint64,1000000000) << tsc_to_ns_shift)
+                            / _tsc_counts_per_sec
+                            > CAST(uint64,0xffffffff))
+                    tsc_to_ns_shift--;
+                  tsc_to_ns_mult
+                    = (CAST(uint64,1000000000) << tsc_to_ns_shift)
+                      / _tsc_counts_per_sec;
 #ifdef USE_APIC_FOR_TIMER
                   _cpu_bus_multiplier
                     = rational_rationalize
@@ -258,6 +434,8 @@ void setup_time ()
                                         16));
 #endif
 #endif
+                  realtime_at_refpoint
+                    = rtc_seconds_since_epoch () * 1000000000;
                   break;
                 }
 
@@ -275,6 +453,7 @@ void setup_time ()
 
 #ifdef USE_IRQ8_FOR_TIME
   _irq8_counter = 0;
+  register_irq_handler (8, RTC_irq, NULL);
   ENABLE_IRQ(8);
 #endif
 }
@@ -12,6 +12,8 @@
 #include "asm.h"
 #include "vga.h"
 #include "term.h"
+#include "time.h"
+#include "page.h"
 
 //-----------------------------------------------------------------------------
 
@@ -158,6 +160,45 @@ video::video (int mode)
   show_mouse ();
 }
 
+// The frame buffer of modes 17 and 18 is the 64KB VGA window at
+// 0xa0000.  Making it write-combining lets the CPU merge the
+// consecutive byte writes of a row into burst transfers.  Reads of the
+// frame buffer are not cached either way.  Each change of layer is an
+// I/O instruction, which drains the write-combining buffers, so the
+// writes to different planes are never mixed.
+
+void video::enable_write_combining ()
+{
+  if (set_write_combining (_start, 0x10000))
+    cout << "Frame buffer is write-combining\n";
+}
+
+// Measure the throughput of full screen "fill_rect" operations.
+
+void video::benchmark_fill_rect ()
+{
+  const int nb_frames = 16;
+  uint64 start = monotonic_ns ();
+
+  for (int i=0; i<nb_frames; i++)
+    fill_rect (0,
+               0,
+               _width,
+               _height,
+               (i & 1) ? &pattern::gray25 : &pattern::gray50);
+
+  uint64 us = (monotonic_ns () - start) / 1000;
+  uint32 bytes = nb_frames * ((_width * _height) >> 3) * _depth;
+
+  fill_rect (0, 0, _width, _height, &pattern::gray50);
+
+  if (us == 0)
+    us = 1;
+
+  cout << "fill_rect: " << CAST(uint32,us / nb_frames) << " us/frame, "
+       << CAST(uint32,bytes / us) << " MB/s\n";
+}
+
 void video::hide_mouse ()
 {
 #if 0